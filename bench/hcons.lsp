@@ -0,0 +1,3 @@
+(define (hlist n) (if (= n 0) nil (hcons n (hlist (- n 1)))))
+(define (htree d) (if (= d 0) nil (hcons (htree (- d 1)) (htree (- d 1)))))
+(define (run) (and (eql (hlist 100) (hlist 100)) (eql (htree 8) (htree 8))))
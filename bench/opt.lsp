@@ -0,0 +1,5 @@
+(define (square x) (* x x))
+(define (poly x) (+ (square x) (+ (* 3 x) (- 10 4))))
+(define (clamp x) (if (< (* 2 3) 5) (and t 0) (poly x)))
+(define (sum n acc) (if (= n 0) acc (sum (- n 1) (+ acc (clamp n)))))
+(define (run) (sum 20 0))
@@ -0,0 +1,3 @@
+(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(define (copies x n) (if (= n 0) nil (cons x (copies x (- n 1)))))
+(define (run) (pmap fib (copies 6 32)))
@@ -0,0 +1,23 @@
+#!/usr/bin/env bash
+#
+# Time each bench/*.lsp under every set of gctest flags given.  A
+# benchmark defines (run), which is called $RUNS times after loading it.
+#
+#   bench/run.sh "" "-O"
+
+RUNS=${RUNS:-2000}
+TIMEFORMAT=%R
+dir=$(dirname "$0")
+input=$(mktemp)
+trap 'rm -f "$input"' EXIT
+
+for lsp in "$dir"/*.lsp; do
+    cat "$lsp" > "$input"
+    for ((i = 0; i < RUNS; ++i)); do
+        echo '(run)'
+    done >> "$input"
+    for flags in "$@"; do
+        printf '%-20s %-8s ' "$(basename "$lsp")" "${flags:-none}"
+        { time "$dir"/../gctest $flags < "$input" > /dev/null; } 2>&1
+    done
+done
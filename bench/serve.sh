@@ -0,0 +1,68 @@
+#!/usr/bin/env bash
+#
+# Compare a gctest process per job with a warm gctest -s server.  For
+# each bench/*.lsp, $JOBS jobs each call (run) once: a process has to
+# load the benchmark every time, the server loads it once beforehand.
+# Jobs run one at a time for the latency of one, then $PAR at a time
+# for throughput.  Any arguments are flags for gctest.
+#
+#   bench/serve.sh -O
+
+JOBS=${JOBS:-200}
+PAR=${PAR:-4}
+dir=$(dirname "$0")
+gctest=$dir/../gctest
+gcsend=$dir/../gcsend
+tmp=$(mktemp -d)
+sock=$tmp/sock
+server=
+trap '[ -n "$server" ] && kill $server; rm -rf "$tmp"' EXIT
+
+now() {
+    date +%s%N
+}
+
+# run "$@" with stdin from $1's job file $JOBS times, $2 at a time; print ns taken
+runjobs() {
+    local input=$1 par=$2 running=0 i t
+    shift 2
+    t=$(now)
+    for ((i = 0; i < JOBS; ++i)); do
+        "$@" < "$input" > /dev/null &
+        if ((++running >= par)); then
+            wait -n
+            ((--running))
+        fi
+    done
+    wait
+    echo $(($(now) - t))
+}
+
+report() {
+    awk -v name="$1" -v mode="$2" -v serial="$3" -v parallel="$4" \
+        -v jobs="$JOBS" -v par="$PAR" 'BEGIN {
+        printf "%-12s %-8s %8.2f ms/job %8.1f jobs/s at %d\n", name, mode,
+            serial / jobs / 1e6, jobs * 1e9 / parallel, par
+    }'
+}
+
+echo '(run)' > "$tmp/run.lsp"
+for lsp in "$dir"/*.lsp; do
+    name=$(basename "$lsp")
+    cat "$lsp" "$tmp/run.lsp" > "$tmp/job.lsp"
+    report "$name" process \
+        "$(runjobs "$tmp/job.lsp" 1 "$gctest" "$@")" \
+        "$(runjobs "$tmp/job.lsp" "$PAR" "$gctest" "$@")"
+    "$gctest" "$@" -s "$sock" < "$lsp" > /dev/null &
+    server=$!
+    while [ ! -S "$sock" ]; do
+        sleep 0.01
+    done
+    report "$name" server \
+        "$(runjobs "$tmp/run.lsp" 1 "$gcsend" "$sock")" \
+        "$(runjobs "$tmp/run.lsp" "$PAR" "$gcsend" "$sock")"
+    kill $server
+    wait $server 2> /dev/null
+    server=
+    rm -f "$sock"
+done
@@ -0,0 +1,2 @@
+(define (ints n) (cons-stream n (ints (+ n 1))))
+(define (run) (stream-take 10 (stream-filter (lambda (x) (> x 1000)) (ints 1))))
@@ -0,0 +1,7 @@
+(define memo nil)
+(define (mfib n)
+  (if (< n 2) n
+      (if (eql (table-get memo n 0) 0)
+          (table-set! memo n (+ (mfib (- n 1)) (mfib (- n 2))))
+          (table-get memo n))))
+(define (run) (set! memo (make-table)) (mfib 80))
@@ -0,0 +1,2027 @@
+/*
+ * The cell heap and its collectors: mark and sweep, sliding compaction
+ * with -c and deferred reference counting with -r, all sharing one
+ * allocator.  See gc.h for how a program drives it.
+ */
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "log.h"
+#include "gc.h"
+
+enum { MINHEAP = 200 }; /* default heap limits, in cells */
+enum { MAXHEAP = 1 << 22 };
+enum { TARGET = 30 }; /* default survival target, percent */
+enum { SHRINKAFTER = 4 };
+enum { PAGESIZE = 4096 };
+enum { TLABSIZE = 64 };
+enum { LOSLIMIT = 1 << 20 };
+enum { STRHEAPSIZE = 4096 };
+enum { ZCTSIZE = 4096 };
+enum { CANDSIZE = 4096 };
+enum { TABLESIZE = 8 }; /* slots in a new table */
+enum { EMPTY = -3, TOMB = -4 }; /* table slot keys that aren't handles */
+enum { HSETSIZE = 256 };
+enum { HALL, HMARKED, HFREED, HMOVED }; /* which cells hrebuild() keeps */
+
+/*
+ * A table's slots are key, value pairs in a large object, probed
+ * linearly from the key's hash.  A deleted key leaves a tombstone, so
+ * probing goes on past it, and no more than three quarters of the
+ * slots are ever in use, so probing always finds an empty one.
+ */
+struct table_t {
+    lobj_t *slots;
+    int32_t cell; /* the TABLE cell that owns this */
+    int32_t count; /* keys in the table */
+    int32_t used; /* slots holding a key or a tombstone */
+    int weak;
+    struct table_t *prev, *next; /* on weaktabs, if weak */
+};
+
+static table_t *weaktabs = NULL;
+
+/*
+ * The cells hcons(), hnum() and hsym() have handed out, in an open
+ * addressed set hashed by content, so a cons is found by the handles of
+ * its car and cdr.  The set holds no references: every collection
+ * rebuilds it from the cells that survived.
+ */
+static int32_t *hset = NULL; /* EMPTY or a cell */
+static int32_t hsize = 0; /* slots, a power of two */
+static int32_t hcount = 0;
+
+static lobj_t *los = NULL;
+static size_t losbytes = 0;
+static size_t loslimit = LOSLIMIT;
+
+/*
+ * string heap: string bytes are bump-allocated here, each block behind
+ * a header naming the cell that owns it.  gc() slides live blocks down
+ * over dead ones, so the heap never fragments.
+ */
+struct strhdr_t {
+    int32_t owner;
+    int32_t len;
+};
+typedef struct strhdr_t strhdr_t;
+
+static char *strheap = NULL;
+static int32_t strsize = 0;
+static int32_t strtop = 0;
+
+enum { RC_ZCT = 2, RC_PURPLE = 4, RC_GRAY = 8, RC_WHITE = 16, RC_FREE = 32 }; /* flags with -r */
+
+/*
+ * The heap is cells[0..ncells).  Address space for maxcells is reserved
+ * up front, so the heap grows and shrinks in place and cell indices stay
+ * valid; pages above ncells are handed back to the OS.
+ *
+ * cells[maxcells..] is the frame region, NREGION cells for each thread.
+ */
+cell_t *cells;
+int32_t ncells;
+static int32_t mincells = MINHEAP;
+static int32_t maxcells = MAXHEAP;
+static int target = TARGET; /* percent of the heap live data should fill */
+static int nsparse = 0; /* collections in a row that found the heap sparse */
+static int32_t avail = 0;
+static int32_t navail;
+static int32_t top; /* cells[top..ncells) are free, for bump allocation */
+static int32_t *fwd; /* forwarding addresses while compacting */
+static int moving = FALSE; /* compact() is under way */
+int compacting = FALSE;
+int refcounting = FALSE;
+static int32_t *refcnt;
+static int32_t *zct; /* zero count table */
+static int32_t nzct, zctcap;
+static int32_t *cand; /* candidate roots of dead cycles */
+static int32_t ncand, candcap;
+static int32_t *work; /* stack for walking subgraphs */
+static int32_t nwork, workcap;
+static int32_t *rootbuf, *oldbuf; /* cells countroots() counted a reference to */
+static int32_t nrootbuf, rootcap, oldbufcap;
+char **procname;
+
+void (*gc_hook)(int event);
+static enum { MARKING, COUNTING, FORWARDING } rootmode;
+
+static mutator_t *mutators[MAXTHREADS];
+static int nmutators = 0;
+_Thread_local mutator_t *self;
+
+/*
+ * Threads counted in nrunning may touch the heap; a thread that wants
+ * to collect sets stopping and waits until every other one has parked,
+ * either in lockheap() or in blockon(), before it goes ahead.
+ */
+static pthread_mutex_t heaplock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parked = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t resumed = PTHREAD_COND_INITIALIZER;
+static atomic_int stopping;
+static int nrunning = 1;
+
+void callhook(int event);
+static int32_t forward(int32_t ptr);
+void droptlabs(void);
+void untlab(mutator_t *m);
+int gc(void);
+void collect(void);
+void resize(int32_t nlive, int32_t hi);
+void refill(void);
+void reconcile(int cycles);
+void push(int32_t **a, int32_t *n, int32_t *cap, int32_t v);
+int32_t nrefs(int32_t ptr);
+int32_t ref(int32_t ptr, int32_t i);
+void zctadd(int32_t ptr);
+void suspect(int32_t ptr);
+void rootref(int32_t ptr);
+void countroots(void);
+void rcrelease(int32_t ptr);
+void markgray(int32_t ptr);
+void scanblack(int32_t ptr);
+void scan(int32_t ptr);
+int32_t collectwhite(int32_t ptr);
+lobj_t *los_alloc(int32_t len);
+void los_free(lobj_t *obj);
+void freestorage(int32_t ptr);
+int weakkey(table_t *t, int32_t key);
+void markweak(void);
+void clearweak(void);
+uint32_t hashcell(cell_t *c);
+uint32_t hashkey(int32_t key);
+int samekey(int32_t a, int32_t b);
+int32_t probe(lobj_t *slots, int32_t key);
+void rehash(table_t *t, lobj_t *obj);
+void retable(table_t *t);
+int samecell(cell_t *a, cell_t *b);
+int32_t hprobe(int32_t *set, int32_t size, cell_t *c);
+void hrebuild(int how);
+int32_t hfind(cell_t *c);
+int32_t hadd(int32_t ptr);
+int32_t hatom(int32_t ptr);
+int32_t str_alloc(int32_t len);
+void str_compact(void);
+
+/* reserve address space for n objects of size bytes; pages are committed on use */
+static void *
+reserve(size_t n, size_t size)
+{
+    void *p;
+
+    p = mmap(NULL, n * size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Error: can't reserve %zu bytes for the heap\n", n * size);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* hand the pages wholly inside objects [from, to) of a reserved array back */
+static void
+release(void *base, size_t size, int32_t from, int32_t to)
+{
+    uintptr_t lo, hi;
+
+    lo = ((uintptr_t) base + from * size + PAGESIZE - 1) & ~(uintptr_t) (PAGESIZE - 1);
+    hi = ((uintptr_t) base + to * size) & ~(uintptr_t) (PAGESIZE - 1);
+    if (lo < hi)
+        madvise((void *) lo, hi - lo, MADV_DONTNEED);
+}
+
+static int32_t
+envint(char *name, int32_t def, int32_t lo, int32_t hi)
+{
+    char *s, *end;
+    long n;
+
+    if ((s = getenv(name)) == NULL)
+        return def;
+    n = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || n < lo || n > hi) {
+        fprintf(stderr, "Error: %s must be a number from %d to %d\n", name, lo, hi);
+        return def;
+    }
+    return n;
+}
+
+void
+initcells(mutator_t *m)
+{
+    int32_t i;
+
+    mincells = envint("GCTEST_MIN_HEAP", MINHEAP, 2, INT32_MAX - NREGION * MAXTHREADS);
+    maxcells = envint("GCTEST_MAX_HEAP", MAXHEAP, 2, INT32_MAX - NREGION * MAXTHREADS);
+    target = envint("GCTEST_TARGET", TARGET, 1, 99);
+    if (maxcells < mincells)
+        maxcells = mincells;
+    cells = reserve(maxcells + (int64_t) NREGION * MAXTHREADS, sizeof cells[0]);
+    fwd = reserve(maxcells, sizeof fwd[0]);
+    procname = reserve(maxcells, sizeof procname[0]);
+    if (refcounting)
+        refcnt = reserve(maxcells, sizeof refcnt[0]);
+    ncells = top = mincells;
+    addmutator(m);
+    self = m;
+    for (i = 0; i < ncells-1; ++i) {
+        cells[i].type = CONS;
+        cells[i].cons.car = NIL;
+        cells[i].cons.cdr = i+1;
+        cells[i].marked = FALSE;
+    }
+    cells[i].type = CONS;
+    cells[i].cons.car = NIL;
+    cells[i].cons.cdr = NIL;
+    cells[i].marked = FALSE;
+    avail = 0;
+    navail = ncells;
+}
+
+/* give m its slice of the frame region and make its roots visible to gc() */
+void
+addmutator(mutator_t *m)
+{
+    m->roots = NULL;
+    m->rbase = m->rtop = maxcells + nmutators * NREGION;
+    m->rlimit = m->rbase + NREGION;
+    m->ltop = m->llimit = 0;
+    m->tlab = NIL;
+    mutators[nmutators++] = m;
+}
+
+/* take back the mutator added last, for a thread that couldn't start */
+void
+delmutator(mutator_t *m)
+{
+    assert(nmutators > 0 && mutators[nmutators-1] == m);
+    --nmutators;
+}
+
+/* make m the calling thread's, and count it as running from now on */
+void
+bindmutator(mutator_t *m)
+{
+    self = m;
+    pthread_mutex_lock(&heaplock);
+    ++nrunning;
+    pthread_mutex_unlock(&heaplock);
+}
+
+/* take heaplock, first sitting out any collection under way */
+void
+lockheap(void)
+{
+    pthread_mutex_lock(&heaplock);
+    if (stopping) {
+        --nrunning;
+        pthread_cond_signal(&parked);
+        while (stopping)
+            pthread_cond_wait(&resumed, &heaplock);
+        ++nrunning;
+    }
+}
+
+void
+unlockheap(void)
+{
+    pthread_mutex_unlock(&heaplock);
+}
+
+/* wait on cond with heaplock held, parked so a collection can go on meanwhile */
+void
+blockon(pthread_cond_t *cond)
+{
+    --nrunning;
+    pthread_cond_signal(&parked);
+    pthread_cond_wait(cond, &heaplock);
+    while (stopping)
+        pthread_cond_wait(&resumed, &heaplock);
+    ++nrunning;
+}
+
+/* with heaplock held, wait until every other thread has parked */
+void
+stopworld(void)
+{
+    stopping = TRUE;
+    --nrunning;
+    while (nrunning > 0)
+        pthread_cond_wait(&parked, &heaplock);
+    ++nrunning;
+}
+
+/* after a collection the free list is new, so every buffer is stale */
+void
+droptlabs(void)
+{
+    int i;
+
+    for (i = 0; i < nmutators; ++i) {
+        mutators[i]->tlab = NIL;
+        mutators[i]->ltop = mutators[i]->llimit = 0;
+    }
+}
+
+void
+startworld(void)
+{
+    droptlabs();
+    stopping = FALSE;
+    pthread_cond_broadcast(&resumed);
+}
+
+/* with the world stopped, collect: mark from every thread's roots */
+int
+gc(void)
+{
+    struct gc_stack_root *root;
+    mutator_t *m;
+    int32_t i;
+    int32_t nlive, hi;
+    int n, t;
+//    printf("Collecting garbage...\n");
+//    printf("Env: %d\n", env);
+    callhook(GC_BEGIN);
+    for (t = 0; t < nmutators; ++t) {
+        m = mutators[t];
+        for (root = m->roots; root; root = root->prev) {
+//            printf("Starting from cell %d...\n", root->cell);
+            mark(*root->cell);
+        }
+        for (i = m->rbase; i < m->rtop; ++i)
+            mark(i);
+    }
+    rootmode = MARKING;
+    callhook(GC_ROOTS);
+    markweak();
+    hrebuild(HMARKED);
+    callhook(GC_SWEEP);
+    for (i = nlive = 0, hi = -1; i < ncells; ++i) {
+        if (cells[i].marked) {
+            ++nlive;
+            hi = i;
+        }
+    }
+    resize(nlive, hi);
+    n = sweep();
+    for (t = 0; t < nmutators; ++t)
+        for (i = mutators[t]->rbase; i < mutators[t]->rtop; ++i)
+            cells[i].marked = FALSE;
+    str_compact();
+    callhook(GC_END);
+    return n;
+}
+
+/*
+ * Heap sizing policy, applied after every collection: nlive cells
+ * survived and the highest of them is cells[hi].  The heap grows, by
+ * half again at least, as soon as live data fills more than target
+ * percent of it, since each collection would then reclaim too little.
+ * Once SHRINKAFTER collections in a row find it less than half that
+ * full, the free cells above hi are cut off and their pages released,
+ * if that frees an eighth of the heap.  Only the free top of the heap
+ * can go, so it is compact() that lets a heap shrink all the way back.
+ */
+void
+resize(int32_t nlive, int32_t hi)
+{
+    int64_t want;
+    int32_t i;
+
+    want = (int64_t) nlive * 100 / target;
+    if (want > ncells) {
+        nsparse = 0;
+        if (want < ncells + ncells / 2)
+            want = ncells + ncells / 2;
+        if (want > maxcells)
+            want = maxcells;
+        LOG("Growing heap from %d cells", ncells);
+        navail += want - ncells;
+        ncells = want;
+        return;
+    }
+    if ((int64_t) nlive * 200 >= (int64_t) ncells * target) {
+        nsparse = 0;
+        return;
+    }
+    if (++nsparse < SHRINKAFTER)
+        return;
+    nsparse = 0;
+    if (want < mincells)
+        want = mincells;
+    if (want <= hi)
+        want = hi + 1;
+    if (want > ncells - ncells / 8)
+        return;
+    LOG("Shrinking heap from %d cells", ncells);
+    for (i = want; i < ncells; ++i) {
+        freestorage(i);
+        cells[i].type = CONS;
+    }
+    release(cells, sizeof cells[0], want, ncells);
+    release(fwd, sizeof fwd[0], want, ncells);
+    release(procname, sizeof procname[0], want, ncells);
+    navail -= ncells - want;
+    ncells = want;
+    if (top > ncells)
+        top = ncells;
+}
+
+/* with the world stopped, reclaim what the chosen collector can */
+void
+collect(void)
+{
+    if (!refcounting) {
+        gc();
+        return;
+    }
+    callhook(GC_BEGIN);
+    untlab(self);
+    reconcile(avail == NIL && top == ncells);
+    clearweak();
+    hrebuild(HFREED);
+    callhook(GC_SWEEP);
+    resize(ncells - navail, ncells - 1);
+    str_compact();
+    callhook(GC_END);
+}
+
+/* collect from a running thread, as getcell() does when the heap is full */
+void
+collectnow(void)
+{
+    lockheap();
+    stopworld();
+    collect();
+    startworld();
+    unlockheap();
+}
+
+void
+callhook(int event)
+{
+    if (gc_hook != NULL)
+        gc_hook(event);
+}
+
+/* a root the program keeps where the collector can't see it; see gc.h */
+void
+gc_root(int32_t *cell)
+{
+    switch (rootmode) {
+    case MARKING:
+        mark(*cell);
+        break;
+    case COUNTING:
+        rootref(*cell);
+        break;
+    case FORWARDING:
+        *cell = forward(*cell);
+        break;
+    }
+}
+
+int
+gc_live(int32_t ptr)
+{
+    if (ptr < 0 || ptr >= ncells)
+        return TRUE;
+    if (refcounting)
+        return !(cells[ptr].flags & RC_FREE);
+    return cells[ptr].marked && (!moving || fwd[ptr] == ptr);
+}
+
+/*
+ * Deferred reference counting, with -r.  cons(), setcar(), setcdr(),
+ * make_proc() and vector-set! keep refcnt[] up to date for references
+ * from one heap cell to another, but the roots, the frame region and C
+ * locals change far too often to count as they go.  A cell whose count
+ * drops to zero may still be in use from one of those, so it goes into
+ * the zero count table instead of being freed.  At each checkpoint,
+ * countroots() adds a count for what the roots refer to now and takes
+ * back the ones it added last time, and then every cell in the table
+ * that is still at zero is garbage.  That takes time in proportion to
+ * the table and the roots, not the heap.
+ *
+ * Counts can't reclaim cycles, such as a procedure that defines another
+ * one capturing its frame.  A cell whose count drops but stays above
+ * zero is a candidate for being part of a dead cycle, and now and then
+ * the candidates are checked by trial deletion: markgray() subtracts
+ * the references from within their subgraph, scan() makes every cell
+ * that something outside still holds black again, and collectwhite()
+ * frees the rest.
+ */
+
+/* grow *a as needed and push v on it */
+void
+push(int32_t **a, int32_t *n, int32_t *cap, int32_t v)
+{
+    if (*n == *cap) {
+        *cap = *cap ? 2 * *cap : 1024;
+        if ((*a = realloc(*a, *cap * sizeof **a)) == NULL) {
+            fprintf(stderr, "Error: out of memory for reference counting\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*a)[(*n)++] = v;
+}
+
+/* the references a cell holds, for walking the heap without recursion */
+int32_t
+nrefs(int32_t ptr)
+{
+    switch (cells[ptr].type) {
+    case CONS:
+    case LAMBDA:
+    case PROMISE:
+        return 2;
+    case VECTOR:
+        return cells[ptr].vec->len;
+    case FUTURE:
+        return 3;
+    case TABLE:
+        return cells[ptr].tab->slots->len;
+    case NUMBER:
+    case SYMBOL:
+    case STRING:
+        break;
+    }
+    return 0;
+}
+
+int32_t
+ref(int32_t ptr, int32_t i)
+{
+    switch (cells[ptr].type) {
+    case CONS:
+        return i == 0 ? cells[ptr].cons.car : cells[ptr].cons.cdr;
+    case LAMBDA:
+        return i == 0 ? cells[ptr].proc.body : cells[ptr].proc.env;
+    case PROMISE:
+        return i == 0 ? cells[ptr].promise.proc : cells[ptr].promise.value;
+    case VECTOR:
+        return cells[ptr].vec->elts[i];
+    case FUTURE:
+        return i == 0 ? cells[ptr].fut->proc
+            : i == 1 ? cells[ptr].fut->args : cells[ptr].fut->value;
+    case TABLE:
+        if (i % 2 == 0 && weakkey(cells[ptr].tab, cells[ptr].tab->slots->elts[i]))
+            return NIL;
+        return cells[ptr].tab->slots->elts[i];
+    case NUMBER:
+    case SYMBOL:
+    case STRING:
+        break;
+    }
+    return NIL;
+}
+
+void
+zctadd(int32_t ptr)
+{
+    if (cells[ptr].flags & RC_ZCT)
+        return;
+    cells[ptr].flags |= RC_ZCT;
+    push(&zct, &nzct, &zctcap, ptr);
+}
+
+void
+incref(int32_t ptr)
+{
+    if (ptr >= 0 && ptr < ncells)
+        ++refcnt[ptr];
+}
+
+void
+decref(int32_t ptr)
+{
+    if (ptr < 0 || ptr >= ncells)
+        return;
+    assert(refcnt[ptr] > 0);
+    if (--refcnt[ptr] == 0)
+        zctadd(ptr);
+    else
+        suspect(ptr);
+}
+
+/* remember a cell that may have just become part of a dead cycle */
+void
+suspect(int32_t ptr)
+{
+    if (cells[ptr].flags & RC_PURPLE)
+        return;
+    cells[ptr].flags |= RC_PURPLE;
+    push(&cand, &ncand, &candcap, ptr);
+}
+
+void
+rootref(int32_t ptr)
+{
+    if (ptr >= 0 && ptr < ncells) {
+        ++refcnt[ptr];
+        push(&rootbuf, &nrootbuf, &rootcap, ptr);
+    }
+}
+
+/* count the references the roots hold now, and drop those from last time */
+void
+countroots(void)
+{
+    struct gc_stack_root *root;
+    int32_t *old;
+    int32_t nold, oldcap;
+    int32_t i;
+
+    old = rootbuf;
+    nold = nrootbuf;
+    oldcap = rootcap;
+    rootbuf = oldbuf;
+    rootcap = oldbufcap;
+    nrootbuf = 0;
+    for (root = self->roots; root; root = root->prev)
+        rootref(*root->cell);
+    for (i = self->rbase; i < self->rtop; ++i) {
+        rootref(cells[i].cons.car);
+        rootref(cells[i].cons.cdr);
+    }
+    rootmode = COUNTING;
+    callhook(GC_ROOTS);
+    for (i = 0; i < nold; ++i)
+        decref(old[i]);
+    oldbuf = old;
+    oldbufcap = oldcap;
+}
+
+/* give back a thread's allocation buffer, which no sweep will recover */
+void
+untlab(mutator_t *m)
+{
+    int32_t p;
+
+    for ( ; m->ltop < m->llimit; ++navail) {
+        p = m->ltop++;
+        cells[p].type = CONS;
+        cells[p].cons.car = NIL;
+        cells[p].cons.cdr = avail;
+        avail = p;
+    }
+    for ( ; m->tlab != NIL; ++navail) {
+        p = m->tlab;
+        m->tlab = cells[p].cons.cdr;
+        cells[p].cons.cdr = avail;
+        avail = p;
+    }
+}
+
+/* put a dead cell on the free list, without touching what it refers to */
+void
+rcrelease(int32_t ptr)
+{
+    freestorage(ptr);
+    cells[ptr].type = CONS;
+    cells[ptr].cons.car = NIL;
+    cells[ptr].cons.cdr = avail;
+    cells[ptr].flags = RC_FREE;
+    avail = ptr;
+    ++navail;
+}
+
+void
+markgray(int32_t ptr)
+{
+    int32_t p, q;
+    int32_t i, n;
+
+    if (cells[ptr].flags & RC_GRAY)
+        return;
+    cells[ptr].flags |= RC_GRAY;
+    push(&work, &nwork, &workcap, ptr);
+    while (nwork > 0) {
+        p = work[--nwork];
+        for (i = 0, n = nrefs(p); i < n; ++i) {
+            q = ref(p, i);
+            if (q < 0)
+                continue;
+            --refcnt[q];
+            if (!(cells[q].flags & RC_GRAY)) {
+                cells[q].flags |= RC_GRAY;
+                push(&work, &nwork, &workcap, q);
+            }
+        }
+    }
+}
+
+/* undo markgray() for everything reachable from a cell that turned out live */
+void
+scanblack(int32_t ptr)
+{
+    int32_t base;
+    int32_t p, q;
+    int32_t i, n;
+
+    base = nwork;
+    cells[ptr].flags &= ~(RC_GRAY | RC_WHITE);
+    push(&work, &nwork, &workcap, ptr);
+    while (nwork > base) {
+        p = work[--nwork];
+        for (i = 0, n = nrefs(p); i < n; ++i) {
+            q = ref(p, i);
+            if (q < 0)
+                continue;
+            ++refcnt[q];
+            if (cells[q].flags & (RC_GRAY | RC_WHITE)) {
+                cells[q].flags &= ~(RC_GRAY | RC_WHITE);
+                push(&work, &nwork, &workcap, q);
+            }
+        }
+    }
+}
+
+void
+scan(int32_t ptr)
+{
+    int32_t p;
+    int32_t i, n;
+
+    push(&work, &nwork, &workcap, ptr);
+    while (nwork > 0) {
+        p = work[--nwork];
+        if (!(cells[p].flags & RC_GRAY))
+            continue;
+        if (refcnt[p] > 0) {
+            scanblack(p);
+            continue;
+        }
+        cells[p].flags = (cells[p].flags & ~RC_GRAY) | RC_WHITE;
+        for (i = 0, n = nrefs(p); i < n; ++i)
+            if (ref(p, i) >= 0)
+                push(&work, &nwork, &workcap, ref(p, i));
+    }
+}
+
+int32_t
+collectwhite(int32_t ptr)
+{
+    int32_t p, q;
+    int32_t i, n;
+    int32_t nfreed;
+
+    if (!(cells[ptr].flags & RC_WHITE))
+        return 0;
+    cells[ptr].flags &= ~RC_WHITE;
+    push(&work, &nwork, &workcap, ptr);
+    for (nfreed = 0; nwork > 0; ++nfreed) {
+        p = work[--nwork];
+        for (i = 0, n = nrefs(p); i < n; ++i) {
+            q = ref(p, i);
+            if (q >= 0 && (cells[q].flags & RC_WHITE)) {
+                cells[q].flags &= ~RC_WHITE;
+                push(&work, &nwork, &workcap, q);
+            }
+        }
+        rcrelease(p);
+    }
+    return nfreed;
+}
+
+/*
+ * Free every cell in the zero count table that the roots don't refer
+ * to, and whatever that leaves unreferenced in turn.  If cycles is set,
+ * or enough candidates have piled up, look for dead cycles as well.
+ */
+void
+reconcile(int cycles)
+{
+    int32_t i, j, n;
+    int32_t p;
+    int32_t nfreed, ncycle;
+
+    TRACE();
+    countroots();
+    nfreed = ncycle = 0;
+    /* freeing a cell can add more to the table, so read it as a queue */
+    for (i = 0; i < nzct; ++i) {
+        p = zct[i];
+        cells[p].flags &= ~RC_ZCT;
+        if (refcnt[p] > 0)
+            continue;
+        for (n = nrefs(p); n-- > 0; )
+            decref(ref(p, n));
+        rcrelease(p);
+        ++nfreed;
+    }
+    nzct = 0;
+    if (cycles || ncand >= CANDSIZE) {
+        for (i = j = 0; i < ncand; ++i) {
+            p = cand[i];
+            if (!(cells[p].flags & RC_PURPLE))
+                continue;
+            cells[p].flags &= ~RC_PURPLE;
+            if (refcnt[p] == 0)
+                continue;
+            markgray(p);
+            cand[j++] = p;
+        }
+        for (i = 0; i < j; ++i)
+            scan(cand[i]);
+        for (i = 0; i < j; ++i)
+            ncycle += collectwhite(cand[i]);
+        ncand = 0;
+    }
+    LOG("Reconciled: %d cells freed, %d in cycles", nfreed, ncycle);
+    UNTRACE();
+}
+
+/*
+ * Refill this thread's allocation buffer from the heap, collecting if
+ * the heap is out of cells.  It is also where a thread parks when some
+ * other thread wants to collect.
+ */
+void
+refill(void)
+{
+    mutator_t *m = self;
+    int32_t p;
+    int32_t n;
+
+    lockheap();
+    if (m->ltop < m->llimit || m->tlab != NIL) {
+        unlockheap();
+        return;
+    }
+    if ((avail == NIL && top == ncells) || (refcounting && nzct >= ZCTSIZE)) {
+        stopworld();
+        collect();
+        startworld();
+    }
+    if (avail == NIL && top == ncells) {
+        fprintf(stderr, "Error: out of memory: all %d cells are live\n", ncells);
+        exit(EXIT_FAILURE);
+    }
+    if (top < ncells) {
+        n = ncells - top < TLABSIZE ? ncells - top : TLABSIZE;
+        m->ltop = top;
+        m->llimit = top += n;
+    } else {
+        m->tlab = p = avail;
+        for (n = 1; n < TLABSIZE && cells[p].cons.cdr != NIL; ++n)
+            p = cells[p].cons.cdr;
+        avail = cells[p].cons.cdr;
+        cells[p].cons.cdr = NIL;
+    }
+    navail -= n;
+    unlockheap();
+}
+
+int32_t
+getcell(void)
+{
+    mutator_t *m = self;
+    int32_t ptr;
+    TRACE();
+    if ((m->ltop == m->llimit && m->tlab == NIL)
+        || atomic_load_explicit(&stopping, memory_order_relaxed))
+        refill();
+    if (m->ltop < m->llimit) {
+        ptr = m->ltop++;
+    } else {
+        ptr = m->tlab;
+        m->tlab = cells[ptr].cons.cdr;
+    }
+    cells[ptr].type = CONS;
+    cells[ptr].cons.car = 0;
+    cells[ptr].cons.cdr = 0;
+    cells[ptr].marked = FALSE;
+    cells[ptr].flags = 0;
+    if (refcounting) {
+        refcnt[ptr] = 0;
+        zctadd(ptr);
+    }
+    RETURN(ptr);
+}
+
+int32_t
+cons(int32_t a, int32_t b)
+{
+    int32_t ptr;
+    GC_PROTECT(a);
+    GC_PROTECT(b);
+    ptr = getcell();
+    GC_UNPROTECT(b);
+    GC_UNPROTECT(a);
+    assert(ptr != NIL);
+    cells[ptr].cons.car = a;
+    cells[ptr].cons.cdr = b;
+    if (refcounting) {
+        incref(a);
+        incref(b);
+    }
+    LOG("Allocating cons cell %d", ptr);
+//    printmem();
+    return ptr;
+}
+
+/*
+ * Allocate a cons in the frame region, or on the heap once the region
+ * is exhausted.  Region cells are reclaimed by resetting rtop.
+ */
+int32_t
+rcons(int32_t a, int32_t b)
+{
+    int32_t ptr;
+
+    if (self->rtop == self->rlimit)
+        return cons(a, b);
+    ptr = self->rtop++;
+    cells[ptr].type = CONS;
+    cells[ptr].cons.car = a;
+    cells[ptr].cons.cdr = b;
+    cells[ptr].marked = FALSE;
+    cells[ptr].flags = 0;
+    return ptr;
+}
+int32_t
+num(int64_t n)
+{
+    int32_t ptr;
+    TRACE();
+    ptr = getcell();
+    assert(ptr != NIL);
+    LOG("Allocating number %ld at cell %d", n, ptr);
+    cells[ptr].type = NUMBER;
+    cells[ptr].num = n;
+//    printmem();
+    RETURN(ptr);
+}
+
+/*
+ * Large objects are malloc'd individually and chained on the los
+ * list.  A vector cell owns its block; sweep() frees it when the cell
+ * dies.  Crossing loslimit forces a collection first so that dead
+ * vectors give their storage back before the space grows.
+ */
+lobj_t *
+los_alloc(int32_t len)
+{
+    lobj_t *obj;
+    size_t size;
+
+    TRACE();
+    size = sizeof *obj + len * sizeof obj->elts[0];
+    lockheap();
+    if (losbytes + size > loslimit) {
+        stopworld();
+        collect();
+        startworld();
+        while (losbytes + size > loslimit)
+            loslimit *= 2;
+    }
+    obj = malloc(size);
+    if (obj != NULL) {
+        obj->len = len;
+        obj->prev = NULL;
+        obj->next = los;
+        if (los)
+            los->prev = obj;
+        los = obj;
+        losbytes += size;
+    }
+    unlockheap();
+    RETURN(obj);
+}
+
+void
+los_free(lobj_t *obj)
+{
+    TRACE();
+    if (obj->prev)
+        obj->prev->next = obj->next;
+    else
+        los = obj->next;
+    if (obj->next)
+        obj->next->prev = obj->prev;
+    losbytes -= sizeof *obj + obj->len * sizeof obj->elts[0];
+    free(obj);
+    UNTRACE();
+}
+
+int32_t
+make_vector(int32_t len, int32_t fill)
+{
+    int32_t ptr;
+    int32_t i;
+    lobj_t *obj;
+
+    TRACE();
+    GC_PROTECT(fill);
+    obj = los_alloc(len);
+    if (obj == NULL) {
+        GC_UNPROTECT(fill);
+        fprintf(stderr, "Error: out of memory for vector of %d\n", len);
+        RETURN(NIL);
+    }
+    for (i = 0; i < len; ++i)
+        obj->elts[i] = fill;
+    ptr = getcell();
+    GC_UNPROTECT(fill);
+    assert(ptr != NIL);
+    cells[ptr].type = VECTOR;
+    cells[ptr].vec = obj;
+    if (refcounting && fill >= 0)
+        refcnt[fill] += len;
+    RETURN(ptr);
+}
+
+/*
+ * Reserve len bytes (plus a header) at the top of the string heap and
+ * return the offset of the bytes.  When the heap is full we collect,
+ * which compacts it, and only grow it if that didn't free enough.
+ */
+int32_t
+str_alloc(int32_t len)
+{
+    int32_t need;
+    int32_t off;
+    char *p;
+
+    TRACE();
+    need = sizeof(strhdr_t) + ((len + 3) & ~3);
+    lockheap();
+    if (strtop + need > strsize) {
+        /* other threads may be reading strings; move nothing under them */
+        stopworld();
+        collect();
+        if (strtop + need > strsize) {
+            if (strsize == 0)
+                strsize = STRHEAPSIZE;
+            while (strtop + need > strsize)
+                strsize *= 2;
+            p = realloc(strheap, strsize);
+            assert(p != NULL);
+            strheap = p;
+        }
+        startworld();
+    }
+    off = strtop + sizeof(strhdr_t);
+    ((strhdr_t *) (strheap + strtop))->owner = NIL;
+    ((strhdr_t *) (strheap + strtop))->len = len;
+    strtop += need;
+    unlockheap();
+    RETURN(off);
+}
+
+/*
+ * Slide every live string block down to the bottom of the string heap.
+ * A block is live if its owner is still a string cell pointing back at
+ * it; sweep() has already retyped dead cells, so this runs after it.
+ */
+void
+str_compact(void)
+{
+    int32_t from, to;
+    int32_t need;
+    int32_t owner;
+    strhdr_t *h;
+
+    TRACE();
+    for (from = to = 0; from < strtop; from += need) {
+        h = (strhdr_t *) (strheap + from);
+        need = sizeof(strhdr_t) + ((h->len + 3) & ~3);
+        owner = h->owner;
+        if (owner < 0 || cells[owner].type != STRING
+            || cells[owner].str.off != from + sizeof(strhdr_t))
+            continue;
+        if (to != from)
+            memmove(strheap + to, strheap + from, need);
+        cells[owner].str.off = to + sizeof(strhdr_t);
+        to += need;
+    }
+    LOG("String heap %d -> %d bytes", strtop, to);
+    strtop = to;
+    UNTRACE();
+}
+
+int32_t
+make_string(int32_t len)
+{
+    int32_t ptr;
+    int32_t off;
+
+    TRACE();
+    ptr = getcell();
+    assert(ptr != NIL);
+    cells[ptr].type = STRING;
+    cells[ptr].str.off = -1;
+    cells[ptr].str.len = 0;
+    GC_PROTECT(ptr);
+    off = str_alloc(len);
+    GC_UNPROTECT(ptr);
+    ((strhdr_t *) (strheap + off) - 1)->owner = ptr;
+    cells[ptr].str.off = off;
+    cells[ptr].str.len = len;
+    RETURN(ptr);
+}
+
+char *
+strbytes(int32_t ptr)
+{
+    assert(cells[ptr].type == STRING);
+    return strheap + cells[ptr].str.off;
+}
+
+/* free what a dead cell owns off the heap */
+void
+freestorage(int32_t ptr)
+{
+    table_t *t;
+
+    switch (cells[ptr].type) {
+    case VECTOR:
+        los_free(cells[ptr].vec);
+        break;
+    case FUTURE:
+        free(cells[ptr].fut);
+        break;
+    case TABLE:
+        t = cells[ptr].tab;
+        if (t->weak) {
+            if (t->prev)
+                t->prev->next = t->next;
+            else
+                weaktabs = t->next;
+            if (t->next)
+                t->next->prev = t->prev;
+        }
+        los_free(t->slots);
+        free(t);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * True if t holds key without keeping it alive.  Numbers and symbols
+ * are looked up by value, and a fresh one is as good a key as the one
+ * stored, so even a weak table holds on to them.
+ */
+int
+weakkey(table_t *t, int32_t key)
+{
+    return t->weak && key >= 0
+        && cells[key].type != NUMBER && cells[key].type != SYMBOL;
+}
+
+/*
+ * With everything else marked, mark each entry in a live weak table
+ * whose key is marked or held strongly, over again until that marks
+ * nothing new, since a value may be all that keeps another entry's key
+ * alive.  Then drop the entries whose keys are still unmarked.
+ */
+void
+markweak(void)
+{
+    table_t *t;
+    int32_t *e;
+    int32_t i;
+    int again;
+
+    TRACE();
+    do {
+        again = FALSE;
+        for (t = weaktabs; t; t = t->next) {
+            if (!cells[t->cell].marked)
+                continue;
+            e = t->slots->elts;
+            for (i = 0; i < t->slots->len; i += 2) {
+                if (e[i] == EMPTY || e[i] == TOMB || (weakkey(t, e[i]) && !cells[e[i]].marked))
+                    continue;
+                if (e[i] >= 0 && !cells[e[i]].marked) {
+                    mark(e[i]);
+                    again = TRUE;
+                }
+                if (e[i+1] >= 0 && !cells[e[i+1]].marked) {
+                    mark(e[i+1]);
+                    again = TRUE;
+                }
+            }
+        }
+    } while (again);
+    for (t = weaktabs; t; t = t->next) {
+        if (!cells[t->cell].marked)
+            continue;
+        e = t->slots->elts;
+        for (i = 0; i < t->slots->len; i += 2) {
+            if (weakkey(t, e[i]) && !cells[e[i]].marked) {
+                e[i] = TOMB;
+                e[i+1] = NIL;
+                --t->count;
+            }
+        }
+    }
+    UNTRACE();
+}
+
+/* with refcounting, drop the entries of weak tables whose keys were just freed */
+void
+clearweak(void)
+{
+    table_t *t;
+    int32_t *e;
+    int32_t i;
+
+    for (t = weaktabs; t; t = t->next) {
+        e = t->slots->elts;
+        for (i = 0; i < t->slots->len; i += 2) {
+            if (weakkey(t, e[i]) && e[i] < ncells && (cells[e[i]].flags & RC_FREE)) {
+                decref(e[i+1]);
+                e[i] = TOMB;
+                e[i+1] = NIL;
+                --t->count;
+            }
+        }
+    }
+}
+
+/* Fibonacci hashing of a number, a symbol's name or a cons's handles */
+uint32_t
+hashcell(cell_t *c)
+{
+    uint64_t h;
+    char *s;
+
+    switch (c->type) {
+    case NUMBER:
+        h = c->num;
+        break;
+    case SYMBOL:
+        for (h = 0, s = c->sym; *s; ++s)
+            h = h * 31 + (unsigned char) *s;
+        break;
+    default:
+        h = (uint64_t) (uint32_t) c->cons.car << 32 | (uint32_t) c->cons.cdr;
+        break;
+    }
+    return (h * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+/* hashing of what eql compares */
+uint32_t
+hashkey(int32_t key)
+{
+    if (key >= 0 && (cells[key].type == NUMBER || cells[key].type == SYMBOL))
+        return hashcell(&cells[key]);
+    return ((uint64_t) (uint32_t) key * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+int
+samekey(int32_t a, int32_t b)
+{
+    if (a == b)
+        return TRUE;
+    if (a < 0 || b < 0 || cells[a].type != cells[b].type)
+        return FALSE;
+    if (cells[a].type == NUMBER)
+        return cells[a].num == cells[b].num;
+    if (cells[a].type == SYMBOL)
+        return strcmp(cells[a].sym, cells[b].sym) == 0;
+    return FALSE;
+}
+
+/* the slot holding key, or else the one it should go in */
+int32_t
+probe(lobj_t *slots, int32_t key)
+{
+    int32_t mask;
+    int32_t i;
+    int32_t tomb;
+
+    mask = slots->len / 2 - 1;
+    tomb = -1;
+    for (i = hashkey(key) & mask; ; i = (i + 1) & mask) {
+        if (slots->elts[2*i] == EMPTY)
+            return tomb >= 0 ? tomb : i;
+        if (slots->elts[2*i] == TOMB) {
+            if (tomb < 0)
+                tomb = i;
+        } else if (samekey(slots->elts[2*i], key)) {
+            return i;
+        }
+    }
+}
+
+/* move t's entries into the empty slots obj, with heaplock held */
+void
+rehash(table_t *t, lobj_t *obj)
+{
+    int32_t i, j;
+
+    for (i = 0; i < obj->len; i += 2) {
+        obj->elts[i] = EMPTY;
+        obj->elts[i+1] = NIL;
+    }
+    for (i = 0; i < t->slots->len; i += 2) {
+        if (t->slots->elts[i] == EMPTY || t->slots->elts[i] == TOMB)
+            continue;
+        j = probe(obj, t->slots->elts[i]);
+        obj->elts[2*j] = t->slots->elts[i];
+        obj->elts[2*j+1] = t->slots->elts[i+1];
+    }
+    los_free(t->slots);
+    t->slots = obj;
+    t->used = t->count;
+}
+
+/* rehash t in place, once compact() has moved the keys */
+void
+retable(table_t *t)
+{
+    int32_t *old;
+    int32_t n, i, j;
+
+    n = t->slots->len;
+    if ((old = malloc(n * sizeof old[0])) == NULL) {
+        fprintf(stderr, "Error: out of memory rehashing a table\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(old, t->slots->elts, n * sizeof old[0]);
+    for (i = 0; i < n; i += 2) {
+        t->slots->elts[i] = EMPTY;
+        t->slots->elts[i+1] = NIL;
+    }
+    for (i = 0; i < n; i += 2) {
+        if (old[i] == EMPTY || old[i] == TOMB)
+            continue;
+        j = probe(t->slots, old[i]);
+        t->slots->elts[2*j] = old[i];
+        t->slots->elts[2*j+1] = old[i+1];
+    }
+    t->used = t->count;
+    free(old);
+}
+
+int32_t
+make_table(int weak)
+{
+    int32_t ptr;
+    int32_t i;
+    table_t *t;
+
+    TRACE();
+    if ((t = malloc(sizeof *t)) == NULL
+        || (t->slots = los_alloc(2 * TABLESIZE)) == NULL) {
+        free(t);
+        fprintf(stderr, "Error: out of memory for table\n");
+        RETURN(NIL);
+    }
+    for (i = 0; i < t->slots->len; i += 2) {
+        t->slots->elts[i] = EMPTY;
+        t->slots->elts[i+1] = NIL;
+    }
+    t->count = t->used = 0;
+    t->weak = weak;
+    t->prev = t->next = NULL;
+    ptr = getcell();
+    assert(ptr != NIL);
+    t->cell = ptr;
+    cells[ptr].type = TABLE;
+    cells[ptr].tab = t;
+    if (weak) {
+        GC_PROTECT(ptr);
+        lockheap();
+        t->next = weaktabs;
+        if (weaktabs)
+            weaktabs->prev = t;
+        weaktabs = t;
+        unlockheap();
+        GC_UNPROTECT(ptr);
+    }
+    RETURN(ptr);
+}
+
+/*
+ * Tables may be shared between threads, so they are read and written
+ * with heaplock held.  lockheap() may collect, which is why the
+ * arguments are protected first.
+ */
+int32_t
+table_get(int32_t tab, int32_t key, int *foundp)
+{
+    lobj_t *slots;
+    int32_t rval;
+    int32_t i;
+
+    TRACE();
+    GC_PROTECT(tab);
+    GC_PROTECT(key);
+    lockheap();
+    slots = cells[tab].tab->slots;
+    i = probe(slots, key);
+    *foundp = samekey(slots->elts[2*i], key);
+    rval = *foundp ? slots->elts[2*i+1] : NIL;
+    unlockheap();
+    GC_UNPROTECT(key);
+    GC_UNPROTECT(tab);
+    RETURN(rval);
+}
+
+void
+table_set(int32_t tab, int32_t key, int32_t val)
+{
+    table_t *t;
+    lobj_t *obj;
+    int32_t *e;
+    int32_t i, n;
+
+    TRACE();
+    GC_PROTECT(tab);
+    GC_PROTECT(key);
+    GC_PROTECT(val);
+    lockheap();
+    t = cells[tab].tab;
+    /* heaplock is let go to grow the table, so look again after */
+    while (t->slots->elts[2 * (i = probe(t->slots, key))] == EMPTY
+           && (t->used + 1) * 4 > t->slots->len / 2 * 3) {
+        for (n = TABLESIZE; n < 2 * (t->count + 1); n *= 2)
+            ;
+        unlockheap();
+        obj = los_alloc(2 * n);
+        lockheap();
+        if (obj == NULL) {
+            unlockheap();
+            fprintf(stderr, "Error: out of memory for table of %d\n", n);
+            GC_UNPROTECT(val);
+            GC_UNPROTECT(key);
+            GC_UNPROTECT(tab);
+            UNTRACE();
+            return;
+        }
+        if (2 * (t->count + 1) > n)
+            los_free(obj);
+        else
+            rehash(t, obj);
+    }
+    e = t->slots->elts;
+    if (samekey(e[2*i], key)) {
+        if (refcounting) {
+            incref(val);
+            decref(e[2*i+1]);
+        }
+    } else {
+        if (e[2*i] == EMPTY)
+            ++t->used;
+        ++t->count;
+        e[2*i] = key;
+        if (refcounting) {
+            if (!weakkey(t, key))
+                incref(key);
+            incref(val);
+        }
+    }
+    e[2*i+1] = val;
+    unlockheap();
+    GC_UNPROTECT(val);
+    GC_UNPROTECT(key);
+    GC_UNPROTECT(tab);
+    UNTRACE();
+}
+
+int
+table_delete(int32_t tab, int32_t key)
+{
+    table_t *t;
+    int32_t *e;
+    int32_t i;
+    int found;
+
+    TRACE();
+    GC_PROTECT(tab);
+    GC_PROTECT(key);
+    lockheap();
+    t = cells[tab].tab;
+    i = probe(t->slots, key);
+    e = t->slots->elts;
+    if ((found = samekey(e[2*i], key))) {
+        if (refcounting) {
+            if (!weakkey(t, e[2*i]))
+                decref(e[2*i]);
+            decref(e[2*i+1]);
+        }
+        e[2*i] = TOMB;
+        e[2*i+1] = NIL;
+        --t->count;
+    }
+    unlockheap();
+    GC_UNPROTECT(key);
+    GC_UNPROTECT(tab);
+    RETURN(found);
+}
+
+int32_t
+table_count(int32_t tab)
+{
+    int32_t n;
+
+    GC_PROTECT(tab);
+    lockheap();
+    n = cells[tab].tab->count;
+    unlockheap();
+    GC_UNPROTECT(tab);
+    return n;
+}
+
+int
+samecell(cell_t *a, cell_t *b)
+{
+    if (a->type != b->type)
+        return FALSE;
+    switch (a->type) {
+    case NUMBER:
+        return a->num == b->num;
+    case SYMBOL:
+        return strcmp(a->sym, b->sym) == 0;
+    default:
+        return a->cons.car == b->cons.car && a->cons.cdr == b->cons.cdr;
+    }
+}
+
+/* the slot in set holding a cell like c, or else the one it should go in */
+int32_t
+hprobe(int32_t *set, int32_t size, cell_t *c)
+{
+    int32_t i;
+
+    for (i = hashcell(c) & (size - 1); set[i] != EMPTY; i = (i + 1) & (size - 1))
+        if (samecell(&cells[set[i]], c))
+            break;
+    return i;
+}
+
+/*
+ * Rebuild hset, with heaplock held, from the cells in it that how keeps
+ * and with room for as many again: the marked ones after marking, those
+ * not freed after reference counting, or all of them, at the addresses
+ * compact() moved them to or where they are.
+ */
+void
+hrebuild(int how)
+{
+    int32_t *set;
+    int32_t size, n, i, p;
+
+    if (hset == NULL && how != HALL)
+        return;
+    for (i = n = 0; i < hsize; ++i) {
+        if ((p = hset[i]) == EMPTY)
+            continue;
+        if ((how == HMARKED && !cells[p].marked)
+            || (how == HFREED && (cells[p].flags & RC_FREE)))
+            continue;
+        hset[n++] = how == HMOVED ? fwd[p] : p;
+    }
+    for (size = HSETSIZE; size < 2 * n; size *= 2)
+        ;
+    if ((set = malloc(size * sizeof set[0])) == NULL) {
+        fprintf(stderr, "Error: out of memory for hash-consing\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < size; ++i)
+        set[i] = EMPTY;
+    for (i = 0; i < n; ++i)
+        set[hprobe(set, size, &cells[hset[i]])] = hset[i];
+    free(hset);
+    hset = set;
+    hsize = size;
+    hcount = n;
+}
+
+/* the cell in hset like c, or NIL */
+int32_t
+hfind(cell_t *c)
+{
+    int32_t ptr;
+
+    lockheap();
+    ptr = hset ? hset[hprobe(hset, hsize, c)] : EMPTY;
+    unlockheap();
+    return ptr == EMPTY ? NIL : ptr;
+}
+
+/* add the new cell ptr to hset, or return the one another thread added first */
+int32_t
+hadd(int32_t ptr)
+{
+    int32_t i;
+
+    GC_PROTECT(ptr);
+    lockheap();
+    if ((hcount + 1) * 4 > hsize * 3)
+        hrebuild(HALL);
+    i = hprobe(hset, hsize, &cells[ptr]);
+    if (hset[i] == EMPTY) {
+        hset[i] = ptr;
+        ++hcount;
+    } else {
+        ptr = hset[i];
+    }
+    unlockheap();
+    GC_UNPROTECT(ptr);
+    return ptr;
+}
+
+/* the shared copy of a number or symbol, or anything else as it is */
+int32_t
+hatom(int32_t ptr)
+{
+    if (ptr >= 0 && cells[ptr].type == NUMBER)
+        return hnum(cells[ptr].num);
+    if (ptr >= 0 && cells[ptr].type == SYMBOL)
+        return hsym(cells[ptr].sym);
+    return ptr;
+}
+
+int32_t
+hcons(int32_t a, int32_t b)
+{
+    int32_t ptr;
+    cell_t c;
+
+    TRACE();
+    GC_PROTECT(a);
+    GC_PROTECT(b);
+    a = hatom(a);
+    b = hatom(b);
+    c.type = CONS;
+    c.cons.car = a;
+    c.cons.cdr = b;
+    if ((ptr = hfind(&c)) == NIL)
+        ptr = hadd(cons(a, b));
+    GC_UNPROTECT(b);
+    GC_UNPROTECT(a);
+    RETURN(ptr);
+}
+
+int32_t
+hnum(int64_t n)
+{
+    int32_t ptr;
+    cell_t c;
+
+    TRACE();
+    c.type = NUMBER;
+    c.num = n;
+    if ((ptr = hfind(&c)) == NIL)
+        ptr = hadd(num(n));
+    RETURN(ptr);
+}
+
+int32_t
+hsym(char *name)
+{
+    int32_t ptr;
+    cell_t c;
+
+    TRACE();
+    c.type = SYMBOL;
+    c.sym = name;
+    if ((ptr = hfind(&c)) == NIL) {
+        ptr = getcell();
+        assert(ptr != NIL);
+        cells[ptr].type = SYMBOL;
+        cells[ptr].sym = name;
+        ptr = hadd(ptr);
+    }
+    RETURN(ptr);
+}
+
+int32_t
+car(int32_t ptr)
+{
+    TRACE();
+    assert(cells[ptr].type == CONS);
+    RETURN(cells[ptr].cons.car);
+}
+
+void
+setcar(int32_t ptr, int32_t val)
+{
+    TRACE();
+    assert(cells[ptr].type == CONS);
+    if (refcounting && ptr < ncells) {
+        incref(val);
+        decref(cells[ptr].cons.car);
+    }
+    cells[ptr].cons.car = val;
+    UNTRACE();
+}
+
+int32_t
+cdr(int32_t ptr)
+{
+    TRACE();
+    assert(cells[ptr].type == CONS);
+    RETURN(cells[ptr].cons.cdr);
+}
+
+void
+setcdr(int32_t ptr, int32_t val)
+{
+    TRACE();
+    assert(cells[ptr].type == CONS);
+    if (refcounting && ptr < ncells) {
+        incref(val);
+        decref(cells[ptr].cons.cdr);
+    }
+    cells[ptr].cons.cdr = val;
+    UNTRACE();
+}
+
+int64_t
+val(int32_t ptr)
+{
+    assert(cells[ptr].type == NUMBER);
+    return cells[ptr].num;
+}
+
+void
+mark(int32_t ptr)
+{
+    int32_t i;
+    TRACE();
+    /* recurse on car, loop on cdr, so long lists don't eat the C stack */
+    while (ptr >= 0 && !cells[ptr].marked) {
+        cells[ptr].marked = TRUE;
+//    printf("Marked cell %d\n", ptr);
+        switch (cells[ptr].type) {
+        case LAMBDA:
+            mark(cells[ptr].proc.body);
+            ptr = cells[ptr].proc.env;
+            continue;
+        case CONS:
+            mark(car(ptr));
+            ptr = cdr(ptr);
+            continue;
+        case PROMISE:
+            mark(cells[ptr].promise.proc);
+            ptr = cells[ptr].promise.value;
+            continue;
+        case VECTOR:
+            for (i = 0; i < cells[ptr].vec->len; ++i)
+                mark(cells[ptr].vec->elts[i]);
+            break;
+        case FUTURE:
+            mark(cells[ptr].fut->proc);
+            mark(cells[ptr].fut->args);
+            ptr = cells[ptr].fut->value;
+            continue;
+        case TABLE:
+            /* markweak() sees to weak ones */
+            if (cells[ptr].tab->weak)
+                break;
+            for (i = 0; i < cells[ptr].tab->slots->len; ++i)
+                mark(cells[ptr].tab->slots->elts[i]);
+            break;
+        case STRING:
+        case NUMBER:
+        case SYMBOL:
+            break;
+        }
+        break;
+    }
+    UNTRACE();
+}
+
+int32_t
+sweep(void)
+{
+    int32_t i;
+    int32_t nmarked;
+    TRACE();
+    avail = NIL;
+    top = ncells;
+    LOG("Sweeping...");
+    /* downwards, so the free list hands out low cells first */
+    for (i = ncells - 1, nmarked = 0; i >= 0; --i) {
+        if (!cells[i].marked) {
+//            printf("Reclaiming cell %d ", i);
+//            print(i);
+            freestorage(i);
+            cells[i].type = CONS;
+            cells[i].cons.car = NIL;
+            cells[i].cons.cdr = avail;
+            avail = i;
+        } else
+            ++nmarked;
+        cells[i].marked = FALSE;
+    }
+    navail = ncells - nmarked;
+    LOG("%d cells free", navail);
+    RETURN(navail);
+}
+
+static int32_t
+forward(int32_t ptr)
+{
+    return (ptr < 0 || ptr >= ncells) ? ptr : fwd[ptr];
+}
+
+/*
+ * Sliding compaction.  Live cells keep their relative order and end up
+ * packed at the bottom of cells[]; everything above becomes the bump
+ * region.  fwd[] is filled in one pass, every reference held by a live
+ * cell or a root is rewritten through it, and then the cells are moved.
+ * Only safe when the roots are the sole references into the heap and
+ * no future is running, so main() drains the futures first.
+ */
+void
+compact(void)
+{
+    struct gc_stack_root *root;
+    int32_t i, j;
+    int32_t nlive;
+    strhdr_t *h;
+
+    TRACE();
+    if (avail == NIL) {
+        /* only a sweep leaves holes, and it leaves a free list too */
+        UNTRACE();
+        return;
+    }
+    callhook(GC_BEGIN);
+    for (root = self->roots; root; root = root->prev)
+        mark(*root->cell);
+    rootmode = MARKING;
+    callhook(GC_ROOTS);
+    markweak();
+    hrebuild(HMARKED);
+    for (i = nlive = 0; i < ncells; ++i) {
+        if (cells[i].marked)
+            fwd[i] = nlive++;
+        else
+            freestorage(i);
+    }
+    moving = TRUE;
+    callhook(GC_SWEEP);
+    moving = FALSE;
+    rootmode = FORWARDING;
+    callhook(GC_ROOTS);
+    for (i = 0; i < ncells; ++i) {
+        if (!cells[i].marked)
+            continue;
+        switch (cells[i].type) {
+        case CONS:
+            cells[i].cons.car = forward(cells[i].cons.car);
+            cells[i].cons.cdr = forward(cells[i].cons.cdr);
+            break;
+        case LAMBDA:
+            cells[i].proc.body = forward(cells[i].proc.body);
+            cells[i].proc.env = forward(cells[i].proc.env);
+            break;
+        case PROMISE:
+            cells[i].promise.proc = forward(cells[i].promise.proc);
+            cells[i].promise.value = forward(cells[i].promise.value);
+            break;
+        case VECTOR:
+            for (j = 0; j < cells[i].vec->len; ++j)
+                cells[i].vec->elts[j] = forward(cells[i].vec->elts[j]);
+            break;
+        case STRING:
+            h = (strhdr_t *) (strheap + cells[i].str.off) - 1;
+            h->owner = fwd[i];
+            break;
+        case FUTURE:
+            cells[i].fut->cell = fwd[i];
+            cells[i].fut->proc = forward(cells[i].fut->proc);
+            cells[i].fut->args = forward(cells[i].fut->args);
+            cells[i].fut->value = forward(cells[i].fut->value);
+            break;
+        case TABLE:
+            cells[i].tab->cell = fwd[i];
+            for (j = 0; j < cells[i].tab->slots->len; ++j)
+                cells[i].tab->slots->elts[j] = forward(cells[i].tab->slots->elts[j]);
+            break;
+        case NUMBER:
+        case SYMBOL:
+            break;
+        }
+    }
+    for (root = self->roots; root; root = root->prev)
+        *root->cell = forward(*root->cell);
+    for (i = nlive = 0; i < ncells; ++i) {
+        if (!cells[i].marked)
+            continue;
+        cells[nlive] = cells[i];
+        procname[nlive] = procname[i];
+        cells[nlive++].marked = FALSE;
+    }
+    for (i = nlive; i < ncells; ++i) {
+        cells[i].type = CONS;
+        cells[i].marked = FALSE;
+    }
+    /* keys hashed by identity have moved */
+    for (i = 0; i < nlive; ++i)
+        if (cells[i].type == TABLE)
+            retable(cells[i].tab);
+    hrebuild(HMOVED);
+    avail = NIL;
+    top = nlive;
+    navail = ncells - nlive;
+    resize(nlive, nlive - 1);
+    droptlabs();
+    str_compact();
+    callhook(GC_END);
+    LOG("Compacted to %d cells", nlive);
+    UNTRACE();
+}
+
+void
+printstats(void)
+{
+    TRACE();
+    printf("Used %d Free %d Total %d Large %zu String %d/%d\n",
+           ncells-navail, navail, ncells, losbytes, strtop, strsize);
+    UNTRACE();
+}
+void
+printmem(void)
+{
+    int i;
+    printf("+-----------+-----------+\n");
+    printf("|%11s|%11d|\n", "free head", avail);
+    printf("+-----------+-----------+\n");
+    printf("|%11s|%11d|\n", "free count", navail);
+    printf("+=======================+\n");
+    for (i = 0; i < ncells; ++i) {
+        printf("|%2d|", i);
+        switch (cells[i].type) {
+        case LAMBDA:
+            printf("%6s|%6d|%6d| ", "lambda", cells[i].proc.body, cells[i].proc.env);
+//            print(i);
+            break;
+        case NUMBER:
+            printf("%6s|%13ld| ", "number", cells[i].num);
+//            print(i);
+            break;
+        case SYMBOL:
+            printf("%6s|%13s| ", "symbol", cells[i].sym);
+//            print(i);
+            break;
+        case VECTOR:
+            printf("%6s|%13d| ", "vector", cells[i].vec->len);
+            break;
+        case STRING:
+            printf("%6s|%6d|%6d| ", "string", cells[i].str.off, cells[i].str.len);
+            break;
+        case FUTURE:
+            printf("%6s|%6d|%6d| ", "future", cells[i].fut->state, cells[i].fut->value);
+            break;
+        case TABLE:
+            printf("%6s|%13d| ", "table", cells[i].tab->count);
+            break;
+        case PROMISE:
+            printf("%6s|%6d|%6d| ", "delay", cells[i].promise.proc, cells[i].promise.value);
+            break;
+        case CONS:
+            printf("%6s|", "cons");
+            if (cells[i].cons.car == NIL)
+                printf("%6s", "nil");
+            else if (cells[i].cons.car == T)
+                printf("%6s", "t");
+            else
+                printf("%6d", cells[i].cons.car);
+            printf("|");
+            if (cells[i].cons.cdr == NIL)
+                printf("%6s", "nil");
+            else if (cells[i].cons.cdr == T)
+                printf("%6s", "t");
+            else
+                printf("%6d", cells[i].cons.cdr);
+            printf("|\n");
+//            if (cells[i].cons.car != NIL)
+//                print(i);
+//            else
+//                putchar('\n');
+            break;
+        }
+        if (i < ncells-1) {
+            if (cells[i+1].type == CONS) {
+                printf("+--+------+------+------+\n");
+            } else {
+                printf("+--+------+-------------+\n");
+            }
+        } else {
+            if (cells[i].type == CONS) {
+                printf("+--+------+------+------+\n");
+            } else {
+                printf("+--+------+-------------+\n");
+            }
+        }
+    }
+}
+
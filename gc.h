@@ -0,0 +1,214 @@
+/*
+ * libgc: the cell heap and its collectors.
+ *
+ * Every object is a cell, and a program holds on to one by its index in
+ * cells[], an int32_t handle that stays valid while the heap grows and
+ * shrinks.  T and NIL are handles that name no cell.  The collector sees
+ * handles kept in other cells, in the frame region and in registered
+ * roots, but not in C variables: one that has to survive a call that may
+ * allocate is registered with GC_PROTECT() first and dropped with
+ * GC_UNPROTECT() afterwards, in the reverse order.  compact() moves
+ * cells, and rewrites registered roots to follow them.
+ *
+ * initcells() sets up the heap and makes its argument the calling
+ * thread's mutator.  Any other thread that allocates is given one with
+ * addmutator() before it starts and takes it with bindmutator().
+ * getcell() and the allocators built on it collect whenever the heap
+ * runs out, stopping every thread at its next call into the heap.
+ *
+ *   GCTEST_MIN_HEAP   initial and smallest heap, in cells
+ *   GCTEST_MAX_HEAP   largest heap, in cells
+ *   GCTEST_TARGET     percent of the heap live data should fill
+ */
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+enum { MAXTHREADS = 64 };
+enum { NREGION = 4096 }; /* frame region cells per thread */
+
+enum { FALSE, TRUE };
+enum { T = -1, NIL = -2 };
+
+/* large-object space: vector storage lives here, off the cell heap */
+struct lobj_t {
+    struct lobj_t *prev;
+    struct lobj_t *next;
+    int32_t len;
+    int32_t elts[];
+};
+typedef struct lobj_t lobj_t;
+
+/*
+ * A future applies proc to args, or maps it over the first count
+ * elements of args if count isn't -1, on whichever thread gets to it
+ * first: a worker taking it off the job queue or a thread touching it.
+ */
+struct future_t {
+    int32_t cell; /* the FUTURE cell that owns this */
+    int32_t proc;
+    int32_t args;
+    int32_t count;
+    int32_t value;
+    enum { QUEUED, RUNNING, DONE } state;
+    struct future_t *next; /* in the job queue */
+};
+typedef struct future_t future_t;
+
+typedef struct table_t table_t; /* see make_table() */
+
+struct cell_t {
+    union {
+        struct {
+            int32_t car;
+            int32_t cdr;
+        } cons;
+        int64_t num;
+        char *sym;
+        struct {
+            int32_t body; /* procedure body */
+            int32_t env; /* environment where lambda was defined */
+        } proc;
+        lobj_t *vec;
+        struct {
+            int32_t off; /* offset of the bytes in strheap */
+            int32_t len;
+        } str;
+        future_t *fut;
+        struct {
+            int32_t proc; /* what computes the value, NIL once it has */
+            int32_t value;
+        } promise;
+        table_t *tab;
+    };
+    enum {
+        NUMBER,
+        CONS,
+        SYMBOL,
+        LAMBDA,
+        VECTOR,
+        STRING,
+        FUTURE,
+        PROMISE,
+        TABLE
+    } type;
+    char marked;
+    char flags; /* the lowest bit is the program's, the rest the collector's */
+};
+typedef struct cell_t cell_t;
+
+/* roots hold the address of the variable so compact() can update it */
+struct gc_stack_root {
+    int32_t *cell;
+    struct gc_stack_root *prev;
+};
+
+/*
+ * What each thread allocating cells keeps to itself: its roots, its
+ * slice of the frame region and a thread-local allocation buffer of
+ * cells, either a run to bump through or a piece of the free list, that
+ * getcell() hands out without taking heaplock.
+ *
+ * Cells pushed on the frame region with rcons() never reach the
+ * collector; they are popped by setting rtop back, and everything below
+ * rtop is live and is a root.
+ */
+struct mutator_t {
+    struct gc_stack_root *roots;
+    int32_t rbase, rtop, rlimit;
+    int32_t ltop, llimit;
+    int32_t tlab;
+};
+typedef struct mutator_t mutator_t;
+
+extern _Thread_local mutator_t *self;
+
+#define GC_PROTECT(cell) LOG("Protecting cell %d", cell); struct gc_stack_root sr_##cell = { &cell, self->roots }; self->roots = &sr_##cell;
+#define GC_UNPROTECT(c) LOG("Unprotecting cell %d", *sr_##c .cell); self->roots = sr_##c.prev
+
+extern cell_t *cells;
+extern int32_t ncells;
+extern char **procname; /* name a procedure was defined under */
+extern int compacting; /* set before initcells() to allow compact() */
+extern int refcounting; /* set before initcells() for reference counting */
+
+/*
+ * Called, if set, with the world stopped as each collection goes
+ * through its phases.  At GC_ROOTS the program passes any roots it
+ * keeps outside the mutators to gc_root().  At GC_SWEEP, gc_live()
+ * tells whether a cell is still the same object after the collection,
+ * so caches keyed by cell can drop what it doesn't.
+ */
+enum { GC_BEGIN, GC_ROOTS, GC_SWEEP, GC_END };
+extern void (*gc_hook)(int event);
+void gc_root(int32_t *cell);
+int gc_live(int32_t ptr);
+
+void initcells(mutator_t *m);
+void addmutator(mutator_t *m);
+void delmutator(mutator_t *m);
+void bindmutator(mutator_t *m);
+
+/*
+ * heaplock guards the allocator, the string heap and the large-object
+ * space, and programs may guard their own shared state with it.  A
+ * thread blocking with it held must do so in blockon(), so that a
+ * collection can go on meanwhile.
+ */
+void lockheap(void);
+void unlockheap(void);
+void blockon(pthread_cond_t *cond);
+
+int32_t getcell(void);
+int32_t cons(int32_t a, int32_t b);
+int32_t rcons(int32_t a, int32_t b);
+int32_t num(int64_t n);
+int32_t make_vector(int32_t len, int32_t fill);
+int32_t make_string(int32_t len);
+char *strbytes(int32_t ptr);
+int32_t car(int32_t ptr);
+int32_t cdr(int32_t ptr);
+void setcar(int32_t ptr, int32_t val);
+void setcdr(int32_t ptr, int32_t val);
+int64_t val(int32_t ptr);
+
+/*
+ * Hash tables, keyed as eql compares: numbers by value, symbols by name
+ * and anything else by identity.  A weak table drops an entry once its
+ * key is garbage but for the table, and keeps the value alive only as
+ * long as the key, so a value may refer to its own key.  Keys compared
+ * by value are held strongly.  With refcounting an entry goes when its
+ * key's count drops to zero, which a value referring to it prevents.
+ */
+int32_t make_table(int weak);
+int32_t table_get(int32_t tab, int32_t key, int *foundp);
+void table_set(int32_t tab, int32_t key, int32_t val);
+int table_delete(int32_t tab, int32_t key);
+int32_t table_count(int32_t tab);
+
+/*
+ * Hash-consing: one cell for each number, symbol name and pair of
+ * handles, so structure built from the leaves up with hcons() is shared
+ * wherever it is equal and eql compares it by handle.  hcons() swaps
+ * numbers and symbols for their shared copies first.  Such cells must
+ * never be modified.  They are kept only while something else refers
+ * to them.  hsym() keeps name, which the program has interned.
+ */
+int32_t hcons(int32_t a, int32_t b);
+int32_t hnum(int64_t n);
+int32_t hsym(char *name);
+
+/* with refcounting, a program storing handles in cells itself counts them */
+void incref(int32_t ptr);
+void decref(int32_t ptr);
+
+void collectnow(void);
+void compact(void);
+void printstats(void);
+void printmem(void);
+
+/* a collection's phases, for benchmarks: stop the world with heaplock held */
+void stopworld(void);
+void startworld(void);
+void mark(int32_t ptr);
+int32_t sweep(void);
@@ -0,0 +1,204 @@
+/*
+ * Microbenchmarks for libgc on its own, with no interpreter in the way.
+ *
+ *   gcbench [-n cells]
+ *
+ * alloc       conses allocated and dropped at once, collections included
+ * mark-list   marking a list of n cells
+ * mark-tree   marking a complete binary tree of about n cells
+ * mark-dag    marking n cells that each share an earlier one as their car
+ * sweep-N%    sweeping the whole heap, about N percent of it live
+ *
+ * Each prints the best of RUNS rounds, in millions of cells a second.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "log.h"
+#include "gc.h"
+
+enum { RUNS = 5 };
+enum { NCELLS = 1 << 20 };
+
+static mutator_t mainthread;
+static int32_t n = NCELLS;
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(char *name, int32_t ncells, double secs)
+{
+    printf("%-12s %10d cells %8.1f Mcells/s\n", name, ncells, ncells / secs / 1e6);
+}
+
+static int32_t
+list(int32_t len)
+{
+    int32_t head;
+
+    for (head = NIL; len > 0; --len)
+        head = cons(NIL, head);
+    return head;
+}
+
+static int32_t
+tree(int depth)
+{
+    int32_t left, right;
+
+    if (depth == 0)
+        return NIL;
+    left = tree(depth - 1);
+    GC_PROTECT(left);
+    right = tree(depth - 1);
+    GC_UNPROTECT(left);
+    return cons(left, right);
+}
+
+/* node i is (node i/2 . node i-1), so marking it reaches everything once */
+static int32_t
+dag(int32_t len)
+{
+    int32_t *node;
+    int32_t head;
+    int32_t i;
+
+    node = malloc(len * sizeof node[0]);
+    if (node == NULL) {
+        fprintf(stderr, "gcbench: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    head = NIL;
+    GC_PROTECT(head);
+    for (i = 0; i < len; ++i)
+        node[i] = head = cons(i > 0 ? node[i/2] : NIL, head);
+    GC_UNPROTECT(head);
+    free(node);
+    return head;
+}
+
+static void
+benchalloc(void)
+{
+    double t, best;
+    int32_t i;
+    int r;
+
+    for (r = 0, best = 1e9; r < RUNS; ++r) {
+        t = now();
+        for (i = 0; i < n; ++i)
+            cons(NIL, NIL);
+        t = now() - t;
+        if (t < best)
+            best = t;
+    }
+    report("alloc", n, best);
+}
+
+/* mark from root and time it; the sweep after it only tidies up */
+static void
+benchmark(char *name, int32_t root, int32_t size)
+{
+    double t, best;
+    int r;
+
+    GC_PROTECT(root);
+    collectnow();
+    for (r = 0, best = 1e9; r < RUNS; ++r) {
+        lockheap();
+        stopworld();
+        t = now();
+        mark(root);
+        t = now() - t;
+        sweep();
+        startworld();
+        unlockheap();
+        if (t < best)
+            best = t;
+    }
+    GC_UNPROTECT(root);
+    report(name, size, best);
+}
+
+/*
+ * Fill the heap with a list, short of a collection, and keep the cells
+ * whose index is below percent mod 100.
+ */
+static void
+benchsweep(int percent)
+{
+    int32_t head, p;
+    int32_t nlive, i;
+    double t, best;
+    char name[32];
+    int r;
+
+    collectnow();
+    head = list(ncells - ncells / 32);
+    GC_PROTECT(head);
+    for (p = head, i = 1, nlive = 1; cdr(p) != NIL; ++i) {
+        if (i % 100 < percent) {
+            p = cdr(p);
+            ++nlive;
+        } else {
+            setcdr(p, cdr(cdr(p)));
+        }
+    }
+    for (r = 0, best = 1e9; r < RUNS; ++r) {
+        lockheap();
+        stopworld();
+        mark(head);
+        t = now();
+        sweep();
+        t = now() - t;
+        startworld();
+        unlockheap();
+        if (t < best)
+            best = t;
+    }
+    snprintf(name, sizeof name, "sweep-%d%%", (int) ((int64_t) nlive * 100 / ncells));
+    report(name, ncells, best);
+    GC_UNPROTECT(head);
+    collectnow();
+}
+
+int
+main(int argc, char *argv[])
+{
+    char heap[16];
+    int32_t root;
+    int depth;
+
+    if (argc == 3 && strcmp(argv[1], "-n") == 0 && (n = atoi(argv[2])) > 0)
+        ;
+    else if (argc != 1) {
+        fprintf(stderr, "usage: %s [-n cells]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    /* a heap that never resizes, so every sweep covers the same cells */
+    snprintf(heap, sizeof heap, "%d", n < INT32_MAX / 4 ? 4 * n : n);
+    setenv("GCTEST_MIN_HEAP", heap, 0);
+    initcells(&mainthread);
+    benchalloc();
+    root = list(n);
+    benchmark("mark-list", root, n);
+    for (depth = 1; 2 << depth <= n; ++depth)
+        ;
+    root = tree(depth);
+    benchmark("mark-tree", root, (2 << (depth - 1)) - 1);
+    root = dag(n);
+    benchmark("mark-dag", root, n);
+    benchsweep(10);
+    benchsweep(50);
+    benchsweep(90);
+    return EXIT_SUCCESS;
+}
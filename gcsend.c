@@ -0,0 +1,98 @@
+/*
+ * Send a batch to a gctest server and copy back what it prints.
+ *
+ *   gctest -s socket < prelude.lsp &
+ *   gcsend socket < batch.lsp
+ *
+ * stdin goes to the server as it is read and the results come back as
+ * they are ready, so neither side waits on a full socket.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+enum { BUFSIZE = 1 << 16 };
+
+static char inbuf[BUFSIZE], outbuf[BUFSIZE];
+
+static void
+fail(char *what)
+{
+    fprintf(stderr, "gcsend: %s: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static void
+writeall(int fd, char *buf, ssize_t n)
+{
+    ssize_t w;
+
+    for ( ; n > 0; buf += w, n -= w)
+        if ((w = write(fd, buf, n)) < 0)
+            fail("write");
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    struct pollfd p[2];
+    ssize_t len, off, n;
+    int fd, eof;
+
+    if (argc != 2 || strlen(argv[1]) >= sizeof addr.sun_path) {
+        fprintf(stderr, "usage: %s socket\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, argv[1]);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+        || connect(fd, (struct sockaddr *) &addr, sizeof addr) < 0)
+        fail(argv[1]);
+    signal(SIGPIPE, SIG_IGN);
+    /* inbuf[off..len) is read from stdin but not yet sent */
+    p[0].events = POLLIN;
+    p[1].fd = fd;
+    len = off = 0;
+    eof = 0;
+    for (;;) {
+        p[0].fd = !eof && off == len ? STDIN_FILENO : -1;
+        p[1].events = POLLIN | (off < len ? POLLOUT : 0);
+        if (poll(p, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fail("poll");
+        }
+        if (p[0].revents) {
+            if ((n = read(STDIN_FILENO, inbuf, sizeof inbuf)) < 0)
+                fail("read");
+            if (n == 0) {
+                shutdown(fd, SHUT_WR);
+                eof = 1;
+            }
+            len = n;
+            off = 0;
+        }
+        if (p[1].revents & POLLOUT) {
+            if ((n = write(fd, inbuf + off, len - off)) < 0)
+                fail("send");
+            off += n;
+        }
+        if (p[1].revents & (POLLIN | POLLHUP)) {
+            if ((n = read(fd, outbuf, sizeof outbuf)) < 0)
+                fail("receive");
+            if (n == 0)
+                break;
+            writeall(STDOUT_FILENO, outbuf, n);
+        }
+    }
+    close(fd);
+    return EXIT_SUCCESS;
+}
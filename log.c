@@ -41,3 +41,165 @@ log_msg(char *func, char *fmt, ...)
     va_end(args);
     fputc('\n', stderr);
 }
+
+#ifdef TRACE_RING
+
+/*
+ * Binary tracing: each event is a fixed-size record stored in a ring
+ * buffer, so only the newest RINGSIZE survive.  Names are stored as
+ * pointers and turned into strings once, when the ring is written out
+ * at exit.  See tracedump.c for the reader.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "trace.h"
+
+enum { RINGSIZE = 1 << 20 }; /* a power of two */
+enum { NNAMES = 1 << 12 };
+
+static struct trace_event ring[RINGSIZE];
+static atomic_uint_fast64_t ringpos;
+static atomic_int ringstarted;
+static uint64_t tsc0, ns0;
+
+static void ring_dump(void);
+
+static uint64_t
+nsnow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return nsnow();
+#endif
+}
+
+static void
+ring_start(void)
+{
+    int expected = 0;
+
+    if (!atomic_compare_exchange_strong(&ringstarted, &expected, 1))
+        return;
+    tsc0 = ticks();
+    ns0 = nsnow();
+    atexit(ring_dump);
+}
+
+void
+ring_event(int kind, const char *name, int64_t arg)
+{
+    struct trace_event *ev;
+    uint64_t i;
+
+    if (!atomic_load_explicit(&ringstarted, memory_order_relaxed))
+        ring_start();
+    i = atomic_fetch_add_explicit(&ringpos, 1, memory_order_relaxed);
+    ev = &ring[i & (RINGSIZE - 1)];
+    ev->tsc = ticks();
+    ev->id = (uintptr_t) name;
+    ev->arg = arg;
+    ev->kind = kind;
+}
+
+/* record the first integer fmt would print as the event's argument */
+void
+ring_log(const char *func, const char *fmt, ...)
+{
+    va_list args;
+    int64_t arg = 0;
+    int islong;
+    const char *p;
+
+    (void) func;
+    va_start(args, fmt);
+    for (p = fmt; (p = strchr(p, '%')) != NULL; ) {
+        ++p;
+        if (*p == '%') {
+            ++p;
+            continue;
+        }
+        for (islong = 0; *p == 'l' || *p == 'z'; ++p)
+            islong = 1;
+        if (*p == 's') {
+            (void) va_arg(args, char *);
+            continue;
+        }
+        if (*p == 'd' || *p == 'i' || *p == 'u' || *p == 'x')
+            arg = islong ? va_arg(args, long) : va_arg(args, int);
+        break;
+    }
+    va_end(args);
+    ring_event(EV_LOG, fmt, arg);
+}
+
+static void
+ring_dump(void)
+{
+    static uint64_t names[NNAMES];
+    struct trace_header hdr;
+    struct trace_string str;
+    uint64_t first, n, i;
+    unsigned h;
+    FILE *fp;
+    char *path;
+
+    if ((path = getenv("GCTEST_TRACE")) == NULL)
+        path = "gctest.trace";
+    if ((fp = fopen(path, "wb")) == NULL) {
+        perror(path);
+        return;
+    }
+    n = atomic_load(&ringpos);
+    first = n > RINGSIZE ? n - RINGSIZE : 0;
+    memset(&hdr, 0, sizeof hdr);
+    hdr.magic = TRACE_MAGIC;
+    hdr.nevents = n - first;
+    hdr.lost = first;
+    hdr.tsc0 = tsc0;
+    hdr.ns0 = ns0;
+    hdr.tsc1 = ticks();
+    hdr.ns1 = nsnow();
+    for (i = first; i < n; ++i) {
+        for (h = ring[i % RINGSIZE].id % NNAMES; names[h] != 0; h = (h + 1) % NNAMES)
+            if (names[h] == ring[i % RINGSIZE].id)
+                break;
+        if (names[h] == 0 && hdr.nstrings < NNAMES - 1) {
+            names[h] = ring[i % RINGSIZE].id;
+            ++hdr.nstrings;
+        }
+    }
+    fwrite(&hdr, sizeof hdr, 1, fp);
+    for (h = 0; h < NNAMES; ++h) {
+        if (names[h] == 0)
+            continue;
+        str.id = names[h];
+        str.len = strlen((char *) (uintptr_t) names[h]);
+        fwrite(&str, sizeof str, 1, fp);
+        fwrite((char *) (uintptr_t) names[h], 1, str.len, fp);
+    }
+    if (first % RINGSIZE + hdr.nevents > RINGSIZE) {
+        fwrite(&ring[first % RINGSIZE], sizeof ring[0], RINGSIZE - first % RINGSIZE, fp);
+        fwrite(ring, sizeof ring[0], n % RINGSIZE, fp);
+    } else {
+        fwrite(&ring[first % RINGSIZE], sizeof ring[0], hdr.nevents, fp);
+    }
+    fclose(fp);
+}
+
+#endif
@@ -1,4 +1,20 @@
-#ifndef NDEBUG
+#if defined(TRACE_RING)
+
+#include "trace.h"
+
+extern void ring_event (int kind, const char *name, int64_t arg);
+extern void ring_log   (const char *func, const char *fmt, ...);
+
+#define TRACE() ring_event(EV_ENTER, __func__, 0)
+#define UNTRACE() ring_event(EV_EXIT, __func__, 0)
+#define RETURN(val) do {              \
+        ring_event(EV_EXIT, __func__, 0); \
+        return (val);                 \
+    } while (0)
+
+#define LOG(...) ring_log(__func__, __VA_ARGS__)
+
+#elif !defined(NDEBUG)
 
 extern void log_trace  (const char *func);
 extern void log_untrace(const char *func);
@@ -5,66 +5,67 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "log.h"
+#include "gc.h"
 #include "sym.h"
+#include "prof.h"
+#include "serve.h"
 
 #define NELEM(a) (sizeof(a)/sizeof(a[0]))
 
-enum { MAXCELLS = 200 };
-
-static int32_t T = -1;
-static int32_t NIL = -2;
-
-enum { FALSE, TRUE };
-
-struct cell_t {
-    union {
-        struct {
-            int32_t car;
-            int32_t cdr;
-        } cons;
-        int64_t num;
-        char *sym;
-        struct {
-            int32_t body; /* procedure body */
-            int32_t env; /* environment where lambda was defined */
-        } proc;
-    };
-    enum {
-        NUMBER,
-        CONS,
-        SYMBOL,
-        LAMBDA
-    } type;
-    char marked;
+enum { NICACHE = 256 };
+enum { WORKERSTACK = 64 << 20 };
+
+enum { PROC_LEAF = 1 }; /* flags: body never creates a closure */
+
+static future_t *jobs = NULL;
+static future_t *lastjob = NULL;
+
+static int profiling = FALSE;
+static int32_t topenv; /* the global environment */
+static int32_t batchenv; /* the frame of the batch being served, or topenv */
+
+/*
+ * Inline caches for calls to global procedures, indexed by the call-site
+ * cons.  An entry is good while globalversion is unchanged; define and
+ * a set! of a global bump it, and the collector drops entries whose call
+ * site or binding has died or moved.
+ */
+struct icache_t {
+    int32_t site;
+    int32_t binding;
+    uint32_t version;
 };
-typedef struct cell_t cell_t;
+typedef struct icache_t icache_t;
 
-static cell_t cells[MAXCELLS];
-static int32_t avail = 0;
-static int32_t navail = MAXCELLS;
+static atomic_uint globalversion = 1; /* futures read it while define bumps it */
 
-void initcells(void);
+/*
+ * What each thread running Lisp code keeps to itself: the mutator the
+ * collector knows it by, and its inline caches.
+ */
+struct thread_t {
+    mutator_t m;
+    icache_t icache[NICACHE];
+};
+typedef struct thread_t thread_t;
+
+static thread_t mainthread;
+static thread_t *threads[MAXTHREADS];
+static int nthreads = 0;
+static _Thread_local thread_t *me;
 
-int gc(void);
-void mark(int32_t ptr);
-int32_t sweep(void);
+void gcevent(int event);
 int32_t lookup(int32_t name, int32_t env, int *foundp);
 
-int32_t getcell(void);
-int32_t num(int64_t n);
-int64_t val(int32_t ptr);
 void printrec(int32_t ptr);
 void print(int32_t ptr);
 int32_t readlist(FILE *fp);
-void printstats(void);
+void skipspace(FILE *fp);
 int32_t sym(char *s);
 
-int32_t cons(int32_t a, int32_t b);
-int32_t car(int32_t ptr);
-int32_t cdr(int32_t ptr);
-void setcar(int32_t ptr, int32_t val);
-void setcdr(int32_t ptr, int32_t val);
 int32_t eql(int32_t a, int32_t b);
 int32_t nullp(int32_t ptr);
 int32_t read(FILE *fp);
@@ -73,6 +74,13 @@ int32_t zip(int32_t (*fn)(int32_t, int32_t), int32_t list1, int32_t list2);
 int32_t mapenv(int32_t (*fn)(int32_t t, int32_t e), int32_t list, int32_t env);
 int32_t eval(int32_t expr, int32_t env);
 int32_t apply(int32_t lambda, int32_t params, int32_t env);
+int32_t applyleaf(int32_t proc, int32_t args, int32_t env, int evalp);
+int32_t applyv(int32_t proc, int32_t args);
+int32_t nth(int32_t n, int32_t list);
+int32_t reverse(int32_t list);
+int32_t map(int32_t proc, int32_t list);
+int32_t filter(int32_t proc, int32_t list);
+int32_t fold(int32_t proc, int32_t init, int32_t list);
 int32_t listp(int32_t obj);
 int32_t symbolp(int32_t obj);
 char * getsym(int32_t ptr);
@@ -82,16 +90,62 @@ int32_t append(int32_t list1, int32_t list2);
 int32_t first(int32_t list);
 int32_t second(int32_t list);
 int32_t third(int32_t list);
+int32_t vectorp(int32_t obj);
+int32_t tablep(int32_t obj);
+int symcmp(int32_t sym, char *s);
+int specialp(int32_t name);
+int32_t memsym(int32_t name, int32_t list);
+int32_t freevars(int32_t expr, int32_t bound, int32_t fv);
+int32_t freebody(int32_t params, int32_t body, int32_t bound, int32_t fv);
+int32_t closure_env(int32_t body, int32_t env);
+void predefine(int32_t frame, int32_t body);
+int leafp(int32_t body);
+int32_t lookupcall(int32_t site, int32_t env, int *foundp);
+int32_t stringp(int32_t obj);
+int32_t string_append(int32_t list);
+int32_t string_compare(int32_t a, int32_t b);
+int32_t readstring(FILE *fp);
+int constval(int32_t expr, int32_t scope);
+int numberp(int32_t expr);
+int32_t optlist(int32_t list, int32_t scope);
+int32_t optbody(int32_t params, int32_t body, int32_t scope);
+void uninline(int32_t name);
+int exprsize(int32_t expr, int limit);
+int inlinebad(int32_t expr, int32_t name);
+void addinline(int32_t name, int32_t params, int32_t body);
+int captured(int32_t expr, int32_t params, int32_t scope);
+int32_t subst(int32_t expr, int32_t params, int32_t args);
+int32_t inlinecall(int32_t name, int32_t args, int32_t scope);
+int32_t boolconst(int truth, int32_t scope);
+int32_t foldconst(int32_t name, int32_t args, int32_t scope);
+int32_t prune(int32_t args, int32_t scope, int stop, int skip1, int skip2);
+int32_t optexpr(int32_t expr, int32_t scope);
+int32_t optimize(int32_t expr, int32_t env);
+int32_t mapn(int32_t proc, int32_t list, int32_t n);
+int32_t make_future(int32_t proc, int32_t args, int32_t count);
+void runfuture(int32_t ptr);
+int32_t touch(int32_t ptr);
+int32_t pmap(int32_t proc, int32_t list);
+int32_t make_promise(int32_t proc);
+int32_t force(int32_t ptr);
+int32_t stream_cdr(int32_t s);
+int32_t stream_take(int64_t n, int32_t s);
+int32_t stream_filter(int32_t proc, int32_t s);
+void drain(void);
+void repl(FILE *fp, int32_t env);
+int serve(char *path);
+void startworkers(int n);
+future_t *popjob(void);
+void *worker(void *arg);
 
-struct gc_stack_root {
-    int32_t cell;
-    struct gc_stack_root *prev;
-};
-
-struct gc_stack_root *gc_roots = NULL;
-
-#define GC_PROTECT(cell) LOG("Protecting cell %d", cell); struct gc_stack_root sr_##cell = { cell, gc_roots }; gc_roots = &sr_##cell;
-#define GC_UNPROTECT(c) LOG("Unprotecting cell %d", sr_##c .cell); gc_roots = sr_##c.prev
+/*
+ * heaplock also guards the symbol table and the futures.  A worker is
+ * counted as running only while it runs a future, so idle ones never
+ * hold up a collection.
+ */
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER; /* a future was queued or finished, or a filter forced */
+static int nworkers = 0;
+static int nbusy = 0; /* workers running a future */
 
 int32_t
 make_proc(int32_t body, int32_t env)
@@ -102,6 +156,8 @@ make_proc(int32_t body, int32_t env)
 
     GC_PROTECT(body);
     GC_PROTECT(env);
+    if (env != topenv && env != batchenv)
+        env = closure_env(body, env);
     ptr = getcell();
     GC_UNPROTECT(env);
     GC_UNPROTECT(body);
@@ -110,72 +166,721 @@ make_proc(int32_t body, int32_t env)
     cells[ptr].type = LAMBDA;
     cells[ptr].proc.body = body;
     cells[ptr].proc.env = env;
+    if (refcounting) {
+        incref(body);
+        incref(env);
+    }
+    procname[ptr] = NULL;
+    if (leafp(cdr(body)))
+        cells[ptr].flags |= PROC_LEAF;
     RETURN(ptr);
 }
 
-void
-printmem(void)
+/* forms eval() handles itself; their names are never variables */
+static char *specials[] = {
+    "env", "quote", "nullp", "atomp", "lambda", "print", "read",
+    "cons", "hcons", "list", "reverse", "append", "nth", "map", "filter", "fold",
+    "future", "touch", "pmap",
+    "delay", "force", "cons-stream", "stream-car", "stream-cdr",
+    "stream-take", "stream-filter",
+    "car", "cdr", "eql", ">", ">=", "<", "<=", "=", "*", "+", "-",
+    "make-vector", "vector-length", "vector-ref", "vector-set!",
+    "make-table", "make-weak-table", "table-get", "table-set!",
+    "table-delete!", "table-count",
+    "string-length", "substring", "string-append", "string=?", "string<?",
+    "or", "set!", "and", "not", "if", "define"
+};
+
+int
+specialp(int32_t name)
 {
     int i;
-    printf("+-----------+-----------+\n");
-    printf("|%11s|%11d|\n", "free head", avail);
-    printf("+-----------+-----------+\n");
-    printf("|%11s|%11d|\n", "free count", navail);
-    printf("+=======================+\n");
-    for (i = 0; i < MAXCELLS; ++i) {
-        printf("|%2d|", i);
-        switch (cells[i].type) {
-        case LAMBDA:
-            printf("%6s|%6d|%6d| ", "lambda", cells[i].proc.body, cells[i].proc.env);
-//            print(i);
+    for (i = 0; i < NELEM(specials); ++i)
+        if (symcmp(name, specials[i]) == 0)
+            return TRUE;
+    return FALSE;
+}
+
+int32_t
+memsym(int32_t name, int32_t list)
+{
+    for ( ; list != NIL; list = cdr(list))
+        if (cells[car(list)].sym == cells[name].sym)
+            return T;
+    return NIL;
+}
+
+/*
+ * Add the variables expr refers to but doesn't bind to the list fv.
+ * Returns T instead of a list if expr captures its whole environment
+ * with (env), since then there is nothing to flatten.
+ */
+int32_t
+freevars(int32_t expr, int32_t bound, int32_t fv)
+{
+    int32_t head;
+
+    TRACE();
+    if (fv == T || expr < 0)
+        RETURN(fv);
+    if (cells[expr].type == SYMBOL) {
+        if (memsym(expr, bound) == T || memsym(expr, fv) == T)
+            RETURN(fv);
+        RETURN(cons(expr, fv));
+    }
+    if (cells[expr].type != CONS)
+        RETURN(fv);
+    GC_PROTECT(fv);
+    head = car(expr);
+    if (head >= 0 && cells[head].type == SYMBOL) {
+        if (symcmp(head, "quote") == 0) {
+            GC_UNPROTECT(fv);
+            RETURN(fv);
+        }
+        if (symcmp(head, "env") == 0) {
+            GC_UNPROTECT(fv);
+            RETURN(T);
+        }
+        if (symcmp(head, "lambda") == 0) {
+            fv = freebody(second(expr), cdr(cdr(expr)), bound, fv);
+            GC_UNPROTECT(fv);
+            RETURN(fv);
+        }
+        if (symcmp(head, "define") == 0 && cells[second(expr)].type == CONS) {
+            fv = freebody(cdr(second(expr)), cdr(cdr(expr)), bound, fv);
+            GC_UNPROTECT(fv);
+            RETURN(fv);
+        }
+        if (symcmp(head, "define") == 0)
+            expr = cdr(expr);
+        if (specialp(head))
+            expr = cdr(expr);
+    }
+    for ( ; expr != NIL && cells[expr].type == CONS; expr = cdr(expr))
+        fv = freevars(car(expr), bound, fv);
+    GC_UNPROTECT(fv);
+    RETURN(fv);
+}
+
+/* free variables of a procedure with the given parameters and body */
+int32_t
+freebody(int32_t params, int32_t body, int32_t bound, int32_t fv)
+{
+    int32_t p;
+    int32_t def;
+
+    TRACE();
+    GC_PROTECT(fv);
+    GC_PROTECT(bound);
+    for (p = params; p != NIL && cells[p].type == CONS; p = cdr(p))
+        bound = cons(car(p), bound);
+    for (p = body; p != NIL; p = cdr(p)) {
+        def = car(p);
+        if (def < 0 || cells[def].type != CONS || car(def) < 0
+            || cells[car(def)].type != SYMBOL || symcmp(car(def), "define") != 0)
+            continue;
+        def = second(def);
+        bound = cons(cells[def].type == CONS ? car(def) : def, bound);
+    }
+    for (p = body; p != NIL; p = cdr(p))
+        fv = freevars(car(p), bound, fv);
+    GC_UNPROTECT(bound);
+    GC_UNPROTECT(fv);
+    RETURN(fv);
+}
+
+/*
+ * Build the environment for a closure over body created in env.  Rather
+ * than keeping the whole chain of enclosing frames alive, the closure
+ * gets a single frame holding just the bindings its free variables
+ * resolve to, in front of the global environment, or of the frame of
+ * the batch being served, since a later define there must still hide a
+ * global.  The binding pairs themselves are shared, so set! is still
+ * seen by everyone who captured the variable.  A variable bound nowhere
+ * yet keeps the full chain.
+ */
+int32_t
+closure_env(int32_t body, int32_t env)
+{
+    int32_t fv;
+    int32_t captured;
+    int32_t binding;
+    int32_t e, base;
+    int foundp;
+
+    TRACE();
+    fv = freebody(car(body), cdr(body), NIL, NIL);
+    if (fv == T)
+        RETURN(env);
+    for (base = env; base != NIL && base != topenv && base != batchenv; base = cdr(base))
+        ;
+    captured = NIL;
+    GC_PROTECT(fv);
+    GC_PROTECT(captured);
+    for ( ; fv != NIL; fv = cdr(fv)) {
+        binding = NIL;
+        for (e = env; e != base; e = cdr(e))
+            if ((binding = assoc(car(fv), car(e))) != NIL)
+                break;
+        if (binding != NIL) {
+            captured = cons(car(binding), captured);
+            continue;
+        }
+        lookup(car(fv), base, &foundp);
+        if (!foundp) {
+            GC_UNPROTECT(captured);
+            GC_UNPROTECT(fv);
+            RETURN(env);
+        }
+    }
+    if (captured != NIL)
+        captured = cons(captured, base);
+    GC_UNPROTECT(captured);
+    GC_UNPROTECT(fv);
+    RETURN(captured == NIL ? base : captured);
+}
+
+/*
+ * True if evaluating the expressions in body can never make a closure
+ * or hand out its environment, so a frame for it can't outlive the call.
+ */
+int
+leafp(int32_t body)
+{
+    int32_t expr;
+    int32_t head;
+
+    for ( ; body >= 0 && cells[body].type == CONS; body = cdr(body)) {
+        expr = car(body);
+        if (expr < 0 || cells[expr].type != CONS)
+            continue;
+        head = car(expr);
+        if (head >= 0 && cells[head].type == SYMBOL) {
+            if (symcmp(head, "quote") == 0)
+                continue;
+            if (symcmp(head, "lambda") == 0 || symcmp(head, "env") == 0
+                || symcmp(head, "future") == 0 || symcmp(head, "delay") == 0
+                || symcmp(head, "cons-stream") == 0)
+                return FALSE;
+            if (symcmp(head, "define") == 0 && cdr(expr) != NIL
+                && second(expr) >= 0 && cells[second(expr)].type == CONS)
+                return FALSE;
+        }
+        if (!leafp(expr))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Source-level optimizer, run over each top-level expression before it
+ * is evaluated when gctest is started with -O.  It folds arithmetic and
+ * comparisons on literal numbers, drops if/and/or/not operands whose
+ * value is known, and inlines calls to small top-level procedures.  The
+ * result is a fresh expression; the one that was read is not modified.
+ * Like an inline declaration, inlining assumes the procedure isn't going
+ * to change: redefining it only affects code optimized after that.
+ *
+ * scope lists the names bound by enclosing lambdas, which may shadow t,
+ * nil or a procedure that would otherwise be inlined.
+ */
+enum { INLINESIZE = 16 }; /* most conses in an inlinable procedure body */
+enum { INLINEDEPTH = 4 };
+
+static int optimizing = FALSE;
+static int32_t inlines; /* (name params . expr) for each inlinable procedure */
+static int inlinedepth = 0;
+
+enum { UNKNOWN, KNOWN_T, KNOWN_NIL, KNOWN_OTHER };
+
+/* what expr is sure to evaluate to, as far as if, and, or and not care */
+int
+constval(int32_t expr, int32_t scope)
+{
+    int32_t head;
+
+    if (expr < 0)
+        return UNKNOWN;
+    switch (cells[expr].type) {
+    case SYMBOL:
+        if (memsym(expr, scope) == T)
+            return UNKNOWN;
+        if (symcmp(expr, "t") == 0)
+            return KNOWN_T;
+        if (symcmp(expr, "nil") == 0)
+            return KNOWN_NIL;
+        return UNKNOWN;
+    case CONS:
+        head = car(expr);
+        if (head < 0 || cells[head].type != SYMBOL || symcmp(head, "quote") != 0
+            || cdr(expr) == NIL)
+            return UNKNOWN;
+        if (second(expr) == NIL)
+            return KNOWN_NIL;
+        return KNOWN_OTHER;
+    default:
+        return KNOWN_OTHER;
+    }
+}
+
+int
+numberp(int32_t expr)
+{
+    return expr >= 0 && cells[expr].type == NUMBER;
+}
+
+/* a fresh list of the optimized expressions in list */
+int32_t
+optlist(int32_t list, int32_t scope)
+{
+    int32_t head, tail, cell;
+
+    TRACE();
+    head = tail = NIL;
+    GC_PROTECT(list);
+    GC_PROTECT(scope);
+    GC_PROTECT(head);
+    for ( ; list != NIL && cells[list].type == CONS; list = cdr(list)) {
+        cell = optexpr(car(list), scope);
+        cell = cons(cell, NIL);
+        if (head == NIL)
+            head = cell;
+        else
+            setcdr(tail, cell);
+        tail = cell;
+    }
+    if (tail != NIL)
+        setcdr(tail, list);
+    GC_UNPROTECT(head);
+    GC_UNPROTECT(scope);
+    GC_UNPROTECT(list);
+    RETURN(head == NIL ? list : head);
+}
+
+/* optimize a lambda body with params and its own defines in scope */
+int32_t
+optbody(int32_t params, int32_t body, int32_t scope)
+{
+    int32_t p;
+    int32_t def;
+
+    TRACE();
+    GC_PROTECT(body);
+    GC_PROTECT(scope);
+    for (p = params; p != NIL && cells[p].type == CONS; p = cdr(p))
+        scope = cons(car(p), scope);
+    for (p = body; p != NIL; p = cdr(p)) {
+        def = car(p);
+        if (def < 0 || cells[def].type != CONS || car(def) < 0
+            || cells[car(def)].type != SYMBOL || symcmp(car(def), "define") != 0)
+            continue;
+        def = second(def);
+        scope = cons(cells[def].type == CONS ? car(def) : def, scope);
+    }
+    body = optlist(body, scope);
+    GC_UNPROTECT(scope);
+    GC_UNPROTECT(body);
+    RETURN(body);
+}
+
+/* forget that name could be inlined */
+void
+uninline(int32_t name)
+{
+    int32_t p, prev;
+
+    for (prev = NIL, p = inlines; p != NIL; prev = p, p = cdr(p)) {
+        if (cells[car(car(p))].sym != cells[name].sym)
+            continue;
+        if (prev == NIL)
+            inlines = cdr(p);
+        else
+            setcdr(prev, cdr(p));
+        return;
+    }
+}
+
+/* number of conses in expr, or more than limit if it has more */
+int
+exprsize(int32_t expr, int limit)
+{
+    int n;
+
+    for (n = 0; expr >= 0 && cells[expr].type == CONS && n <= limit; expr = cdr(expr))
+        n += 1 + exprsize(car(expr), limit - n);
+    return n;
+}
+
+/* true if expr mentions name, or binds or assigns anything */
+int
+inlinebad(int32_t expr, int32_t name)
+{
+    int32_t head;
+
+    if (expr < 0)
+        return FALSE;
+    if (cells[expr].type == SYMBOL)
+        return cells[expr].sym == cells[name].sym;
+    if (cells[expr].type != CONS)
+        return FALSE;
+    head = car(expr);
+    if (head >= 0 && cells[head].type == SYMBOL) {
+        if (symcmp(head, "quote") == 0)
+            return FALSE;
+        if (symcmp(head, "lambda") == 0 || symcmp(head, "define") == 0
+            || symcmp(head, "set!") == 0 || symcmp(head, "env") == 0
+            || symcmp(head, "future") == 0 || symcmp(head, "delay") == 0
+            || symcmp(head, "cons-stream") == 0)
+            return TRUE;
+    }
+    for ( ; expr >= 0 && cells[expr].type == CONS; expr = cdr(expr))
+        if (inlinebad(car(expr), name))
+            return TRUE;
+    return FALSE;
+}
+
+/*
+ * Remember (define (name . params) expr) as inlinable if expr is small,
+ * doesn't call name and can't bind anything a call site might see.
+ */
+void
+addinline(int32_t name, int32_t params, int32_t body)
+{
+    int32_t p;
+
+    uninline(name);
+    if (body == NIL || cdr(body) != NIL)
+        return;
+    for (p = params; p != NIL; p = cdr(p))
+        if (cells[p].type != CONS || car(p) < 0 || cells[car(p)].type != SYMBOL)
+            return;
+    if (exprsize(car(body), INLINESIZE) > INLINESIZE || inlinebad(car(body), name))
+        return;
+    GC_PROTECT(name);
+    p = cons(params, car(body));
+    p = cons(name, p);
+    inlines = cons(p, inlines);
+    GC_UNPROTECT(name);
+}
+
+/* true if a free name of expr other than params is bound in scope */
+int
+captured(int32_t expr, int32_t params, int32_t scope)
+{
+    if (expr < 0)
+        return FALSE;
+    if (cells[expr].type == SYMBOL)
+        return memsym(expr, params) != T && memsym(expr, scope) == T;
+    if (cells[expr].type != CONS)
+        return FALSE;
+    if (car(expr) >= 0 && cells[car(expr)].type == SYMBOL && symcmp(car(expr), "quote") == 0)
+        return FALSE;
+    for ( ; expr >= 0 && cells[expr].type == CONS; expr = cdr(expr))
+        if (captured(car(expr), params, scope))
+            return TRUE;
+    return FALSE;
+}
+
+/* copy of expr with each of params replaced by its argument */
+int32_t
+subst(int32_t expr, int32_t params, int32_t args)
+{
+    int32_t head, tail, cell;
+    int32_t p, a;
+
+    TRACE();
+    if (expr < 0)
+        RETURN(expr);
+    if (cells[expr].type == SYMBOL) {
+        for (p = params, a = args; p != NIL; p = cdr(p), a = cdr(a))
+            if (cells[car(p)].sym == cells[expr].sym)
+                RETURN(car(a));
+        RETURN(expr);
+    }
+    if (cells[expr].type != CONS)
+        RETURN(expr);
+    if (car(expr) >= 0 && cells[car(expr)].type == SYMBOL && symcmp(car(expr), "quote") == 0)
+        RETURN(expr);
+    head = tail = NIL;
+    GC_PROTECT(expr);
+    GC_PROTECT(params);
+    GC_PROTECT(args);
+    GC_PROTECT(head);
+    for ( ; expr >= 0 && cells[expr].type == CONS; expr = cdr(expr)) {
+        cell = subst(car(expr), params, args);
+        cell = cons(cell, NIL);
+        if (head == NIL)
+            head = cell;
+        else
+            setcdr(tail, cell);
+        tail = cell;
+    }
+    setcdr(tail, expr);
+    GC_UNPROTECT(head);
+    GC_UNPROTECT(args);
+    GC_UNPROTECT(params);
+    GC_UNPROTECT(expr);
+    RETURN(head);
+}
+
+/*
+ * The body of the procedure called by (name . args) with the arguments
+ * substituted for its parameters, or NIL if the call can't be inlined.
+ * Arguments must be atoms: substitution may evaluate one more than once,
+ * or not at all, so it has to be both cheap and free of side effects.
+ */
+int32_t
+inlinecall(int32_t name, int32_t args, int32_t scope)
+{
+    int32_t p, a;
+    int32_t params;
+    int32_t body;
+
+    TRACE();
+    if (inlinedepth >= INLINEDEPTH || memsym(name, scope) == T)
+        RETURN(NIL);
+    for (p = inlines; p != NIL; p = cdr(p))
+        if (cells[car(car(p))].sym == cells[name].sym)
             break;
-        case NUMBER:
-            printf("%6s|%13ld| ", "number", cells[i].num);
-//            print(i);
+    if (p == NIL)
+        RETURN(NIL);
+    params = car(cdr(car(p)));
+    body = cdr(cdr(car(p)));
+    for (p = params, a = args; p != NIL && a != NIL; p = cdr(p), a = cdr(a))
+        if (car(a) < 0 || cells[car(a)].type == CONS)
+            RETURN(NIL);
+    if (p != NIL || a != NIL)
+        RETURN(NIL);
+    if (captured(body, params, scope))
+        RETURN(NIL);
+    body = subst(body, params, args);
+    ++inlinedepth;
+    body = optexpr(body, scope);
+    --inlinedepth;
+    RETURN(body);
+}
+
+/* the symbol t or nil for a known truth, or NIL if scope rebinds it */
+int32_t
+boolconst(int truth, int32_t scope)
+{
+    int32_t name;
+
+    name = sym(truth ? "t" : "nil");
+    return memsym(name, scope) == T ? NIL : name;
+}
+
+/* (op a b) on two literal numbers, or NIL if it isn't one of those */
+int32_t
+foldconst(int32_t name, int32_t args, int32_t scope)
+{
+    int64_t a, b;
+
+    TRACE();
+    if (args == NIL || cdr(args) == NIL || cdr(cdr(args)) != NIL
+        || !numberp(car(args)) || !numberp(second(args)))
+        RETURN(NIL);
+    a = val(car(args));
+    b = val(second(args));
+    if (symcmp(name, "+") == 0)
+        RETURN(num(a + b));
+    if (symcmp(name, "-") == 0)
+        RETURN(num(a - b));
+    if (symcmp(name, "*") == 0)
+        RETURN(num(a * b));
+    if (symcmp(name, ">") == 0)
+        RETURN(boolconst(a > b, scope));
+    if (symcmp(name, ">=") == 0)
+        RETURN(boolconst(a >= b, scope));
+    if (symcmp(name, "<") == 0)
+        RETURN(boolconst(a < b, scope));
+    if (symcmp(name, "<=") == 0)
+        RETURN(boolconst(a <= b, scope));
+    if (symcmp(name, "=") == 0)
+        RETURN(boolconst(a == b, scope));
+    RETURN(NIL);
+}
+
+/*
+ * Operands of and/or with the ones whose value is known not to matter
+ * left out: stop is the value that ends the evaluation early, and skip
+ * the values that let it go on.
+ */
+int32_t
+prune(int32_t args, int32_t scope, int stop, int skip1, int skip2)
+{
+    int32_t kept;
+    int k;
+
+    TRACE();
+    kept = NIL;
+    GC_PROTECT(args);
+    GC_PROTECT(kept);
+    for ( ; args != NIL; args = cdr(args)) {
+        k = constval(car(args), scope);
+        if (k == skip1 || k == skip2)
+            continue;
+        kept = cons(car(args), kept);
+        if (k == stop)
             break;
-        case SYMBOL:
-            printf("%6s|%13s| ", "symbol", cells[i].sym);
-//            print(i);
+    }
+    kept = reverse(kept);
+    GC_UNPROTECT(kept);
+    GC_UNPROTECT(args);
+    RETURN(kept);
+}
+
+int32_t
+optexpr(int32_t expr, int32_t scope)
+{
+    int32_t head;
+    int32_t args;
+    int32_t rval;
+
+    TRACE();
+    if (expr < 0 || cells[expr].type != CONS)
+        RETURN(expr);
+    head = car(expr);
+    if (head < 0 || cells[head].type != SYMBOL)
+        RETURN(optlist(expr, scope));
+    if (symcmp(head, "quote") == 0 || symcmp(head, "env") == 0)
+        RETURN(expr);
+    if ((symcmp(head, "lambda") == 0 || symcmp(head, "define") == 0
+         || symcmp(head, "set!") == 0 || symcmp(head, "if") == 0)
+        && (cdr(expr) == NIL || cdr(cdr(expr)) == NIL))
+        RETURN(expr);
+    args = rval = NIL;
+    GC_PROTECT(expr);
+    GC_PROTECT(scope);
+    GC_PROTECT(args);
+    GC_PROTECT(rval);
+    if (symcmp(head, "lambda") == 0) {
+        rval = optbody(second(expr), cdr(cdr(expr)), scope);
+        rval = cons(second(expr), rval);
+        rval = cons(head, rval);
+    } else if (symcmp(head, "define") == 0 && cells[second(expr)].type == CONS) {
+        if (memsym(car(second(expr)), scope) != T)
+            uninline(car(second(expr)));
+        rval = optbody(cdr(second(expr)), cdr(cdr(expr)), scope);
+        rval = cons(second(expr), rval);
+        rval = cons(head, rval);
+    } else if (symcmp(head, "define") == 0 || symcmp(head, "set!") == 0) {
+        if (memsym(second(expr), scope) != T)
+            uninline(second(expr));
+        rval = optlist(cdr(cdr(expr)), scope);
+        rval = cons(second(expr), rval);
+        rval = cons(head, rval);
+    } else if (symcmp(head, "if") == 0) {
+        args = optlist(cdr(expr), scope);
+        switch (constval(car(args), scope)) {
+        case KNOWN_T:
+            rval = second(args);
             break;
-        case CONS:
-            printf("%6s|", "cons");
-            if (cells[i].cons.car == NIL)
-                printf("%6s", "nil");
-            else if (cells[i].cons.car == T)
-                printf("%6s", "t");
-            else
-                printf("%6d", cells[i].cons.car);
-            printf("|");
-            if (cells[i].cons.cdr == NIL)
-                printf("%6s", "nil");
-            else if (cells[i].cons.cdr == T)
-                printf("%6s", "t");
-            else
-                printf("%6d", cells[i].cons.cdr);
-            printf("|\n");
-//            if (cells[i].cons.car != NIL)
-//                print(i);
-//            else
-//                putchar('\n');
+        case KNOWN_NIL:
+        case KNOWN_OTHER:
+            rval = cdr(cdr(args)) != NIL ? third(args) : boolconst(FALSE, scope);
+            break;
+        default:
             break;
         }
-        if (i < MAXCELLS-1) {
-            if (cells[i+1].type == CONS) {
-                printf("+--+------+------+------+\n");
-            } else {
-                printf("+--+------+-------------+\n");
-            }
-        } else {
-            if (cells[i].type == CONS) {
-                printf("+--+------+------+------+\n");
-            } else {
-                printf("+--+------+-------------+\n");
-            }
+        if (rval == NIL)
+            rval = cons(head, args);
+    } else if (symcmp(head, "and") == 0) {
+        args = prune(optlist(cdr(expr), scope), scope, KNOWN_NIL, KNOWN_T, KNOWN_OTHER);
+        if (args == NIL)
+            rval = boolconst(TRUE, scope);
+        else if (cdr(args) == NIL && constval(car(args), scope) == KNOWN_NIL)
+            rval = car(args);
+        if (rval == NIL)
+            rval = cons(head, args);
+    } else if (symcmp(head, "or") == 0) {
+        args = prune(optlist(cdr(expr), scope), scope, KNOWN_T, KNOWN_NIL, KNOWN_OTHER);
+        if (args == NIL)
+            rval = boolconst(FALSE, scope);
+        else if (cdr(args) == NIL && constval(car(args), scope) == KNOWN_T)
+            rval = car(args);
+        if (rval == NIL)
+            rval = cons(head, args);
+    } else if (symcmp(head, "not") == 0 && cdr(expr) != NIL) {
+        args = optlist(cdr(expr), scope);
+        switch (constval(car(args), scope)) {
+        case KNOWN_NIL:
+            rval = boolconst(TRUE, scope);
+            break;
+        case KNOWN_T:
+        case KNOWN_OTHER:
+            rval = boolconst(FALSE, scope);
+            break;
+        default:
+            break;
+        }
+        if (rval == NIL)
+            rval = cons(head, args);
+    } else {
+        args = optlist(cdr(expr), scope);
+        rval = specialp(head) ? foldconst(head, args, scope) : inlinecall(head, args, scope);
+        if (rval == NIL)
+            rval = cons(head, args);
+    }
+    GC_UNPROTECT(rval);
+    GC_UNPROTECT(args);
+    GC_UNPROTECT(scope);
+    GC_UNPROTECT(expr);
+    RETURN(rval);
+}
+
+/*
+ * Optimize an expression to be evaluated in env.  A procedure defined
+ * at top level may be inlined into the expressions that follow, though
+ * not into itself.  A batch may yet define any name in its frame, so
+ * nothing is inlined into it, and the names the frame binds and the one
+ * expr defines hide the globals they shadow.
+ */
+int32_t
+optimize(int32_t expr, int32_t env)
+{
+    int32_t def;
+    int32_t scope, p;
+    int32_t saved;
+
+    TRACE();
+    if (env != topenv) {
+        scope = NIL;
+        saved = inlines;
+        inlines = NIL;
+        GC_PROTECT(saved);
+        GC_PROTECT(expr);
+        GC_PROTECT(scope);
+        for (p = car(env); p != NIL; p = cdr(p))
+            scope = cons(car(car(p)), scope);
+        if (expr >= 0 && cells[expr].type == CONS && car(expr) >= 0
+            && cells[car(expr)].type == SYMBOL && symcmp(car(expr), "define") == 0
+            && cdr(expr) != NIL && second(expr) >= 0) {
+            def = second(expr);
+            scope = cons(cells[def].type == CONS ? car(def) : def, scope);
         }
+        expr = optexpr(expr, scope);
+        GC_UNPROTECT(scope);
+        GC_UNPROTECT(expr);
+        inlines = saved;
+        GC_UNPROTECT(saved);
+        RETURN(expr);
     }
+    expr = optexpr(expr, NIL);
+    if (expr >= 0 && cells[expr].type == CONS && car(expr) >= 0
+        && cells[car(expr)].type == SYMBOL && symcmp(car(expr), "define") == 0
+        && cdr(expr) != NIL && second(expr) >= 0 && cells[second(expr)].type == CONS) {
+        def = second(expr);
+        GC_PROTECT(expr);
+        addinline(car(def), cdr(def), cdr(cdr(expr)));
+        GC_UNPROTECT(expr);
+    }
+    RETURN(expr);
 }
 
 static int peek = 0;
+static FILE *input; /* what read reads: stdin, or a batch being served */
+static int hashconsing = FALSE; /* -H: read everything into shared cells */
 
 void
 initread(FILE *fp)
@@ -220,43 +925,136 @@ add_to_env(int32_t env, int32_t name, int32_t val)
     setcar(env, cons(cons(name, val), car(env)));
 }
 
-int32_t env;
 int
-main(void)
+main(int argc, char *argv[])
+{
+    char *sockpath, *end;
+    long n;
+    int rval;
+    int i;
+
+    TRACE();
+    sockpath = NULL;
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-c") == 0) {
+            compacting = TRUE;
+        } else if (strcmp(argv[i], "-O") == 0) {
+            optimizing = TRUE;
+        } else if (strcmp(argv[i], "-H") == 0) {
+            hashconsing = TRUE;
+        } else if (strcmp(argv[i], "-p") == 0) {
+            profiling = TRUE;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            refcounting = TRUE;
+        } else if (strcmp(argv[i], "-j") == 0 && i+1 < argc
+                   && (n = strtol(argv[i+1], &end, 10)) >= 1 && n < MAXTHREADS
+                   && *end == '\0') {
+            nworkers = n;
+            ++i;
+        } else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+            sockpath = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [-c | -r] [-O] [-H] [-p] [-j workers] [-s socket]\n", argv[0]);
+            RETURN(EXIT_FAILURE);
+        }
+    }
+    if (refcounting && (compacting || nworkers > 0)) {
+        fprintf(stderr, "Error: -r works with neither -c nor -j\n");
+        RETURN(EXIT_FAILURE);
+    }
+    if (profiling)
+        prof_start();
+    gc_hook = gcevent;
+    initcells(&mainthread.m);
+    me = threads[nthreads++] = &mainthread;
+    startworkers(nworkers);
+    topenv = make_env(NIL);
+    add_to_env(topenv, sym("t"), T);
+    add_to_env(topenv, sym("nil"), NIL);
+    GC_PROTECT(topenv);
+    batchenv = topenv;
+    GC_PROTECT(batchenv);
+    inlines = NIL;
+    GC_PROTECT(inlines);
+//    printmem();
+    repl(stdin, topenv);
+    rval = sockpath != NULL ? serve(sockpath) : EXIT_SUCCESS;
+    GC_UNPROTECT(inlines);
+    GC_UNPROTECT(batchenv);
+    GC_UNPROTECT(topenv);
+    RETURN(rval);
+}
+
+/*
+ * Read, evaluate and print each expression from fp in env, which is
+ * the global environment or the frame of a batch being served.
+ */
+void
+repl(FILE *fp, int32_t env)
 {
     int32_t expr;
     int32_t val;
 
-    (void) val;
     TRACE();
-    initcells();
-    env = make_env(NIL);
-    add_to_env(env, sym("t"), T);
-    add_to_env(env, sym("nil"), NIL);
     GC_PROTECT(env);
-//    printmem();
-    initread(stdin);
-    while ((expr = read(stdin)) != EOF) {
-//        printf("Env: ");
-//        print(env);
-//        printf("Read expression: ");
-//        print(expr);
+    input = fp;
+    initread(fp);
+    while ((expr = read(fp)) != EOF) {
         GC_PROTECT(expr);
+        if (optimizing)
+            expr = optimize(expr, env);
         val = eval(expr, env);
         GC_UNPROTECT(expr);
         print(val);
-//        printstats();
-//        printmem();
-//        puts("ENV");
-//        print(env);
+        /* a client waits on each result */
+        if (fp != stdin)
+            fflush(stdout);
+        drain();
+        /*
+         * Nothing but the registered roots refers to the heap between
+         * top-level expressions, so this is the one place cells can
+         * move.
+         */
+        if (compacting)
+            compact();
     }
     GC_UNPROTECT(env);
-    RETURN(EXIT_SUCCESS);
+    UNTRACE();
 }
 
+/*
+ * Serve batches on the socket at path with the heap, symbols and global
+ * environment stdin left behind.  Each is evaluated in a new frame
+ * under the global environment, so what it defines goes with it.  Only
+ * returns if the socket fails.
+ */
+int
+serve(char *path)
+{
+    FILE *fp;
+    int fd;
+
+    TRACE();
+    if ((fd = serve_listen(path)) < 0)
+        RETURN(EXIT_FAILURE);
+    while ((fp = serve_accept(fd)) != NULL) {
+        batchenv = make_env(topenv);
+        repl(fp, batchenv);
+        batchenv = topenv;
+        serve_done(fp);
+    }
+    RETURN(EXIT_FAILURE);
+}
+
+/*
+ * The list builders below all grow their result through a tail pointer
+ * rather than recursing, so they run in constant C stack on any length.
+ * The result is reachable from head, which is protected throughout.
+ */
 int32_t
 append(int32_t list1, int32_t list2)
 {
+    int32_t head, tail, cell;
     TRACE();
     assert(listp(list1) == T);
     assert(listp(list2) == T);
@@ -264,17 +1062,147 @@ append(int32_t list1, int32_t list2)
         RETURN(list2);
     if (list2 == NIL)
         RETURN(list1);
-    RETURN(cons(car(list1), append(cdr(list1), list2)));
+    head = tail = NIL;
+    GC_PROTECT(list1);
+    GC_PROTECT(list2);
+    GC_PROTECT(head);
+    for ( ; list1 != NIL; list1 = cdr(list1)) {
+        cell = cons(car(list1), NIL);
+        if (head == NIL)
+            head = cell;
+        else
+            setcdr(tail, cell);
+        tail = cell;
+    }
+    setcdr(tail, list2);
+    GC_UNPROTECT(head);
+    GC_UNPROTECT(list2);
+    GC_UNPROTECT(list1);
+    RETURN(head);
+}
+
+int32_t
+mapenv(int32_t (*fn)(int32_t t, int32_t e), int32_t list, int32_t env)
+{
+    int32_t head, tail, cell;
+    TRACE();
+    assert(listp(list) == T);
+    head = tail = NIL;
+    GC_PROTECT(list);
+    GC_PROTECT(env);
+    GC_PROTECT(head);
+    for ( ; list != NIL; list = cdr(list)) {
+        cell = cons(fn(car(list), env), NIL);
+        if (head == NIL)
+            head = cell;
+        else
+            setcdr(tail, cell);
+        tail = cell;
+    }
+    GC_UNPROTECT(head);
+    GC_UNPROTECT(env);
+    GC_UNPROTECT(list);
+    RETURN(head);
+}
+
+int32_t
+nth(int32_t n, int32_t list)
+{
+    TRACE();
+    for ( ; n > 0 && list != NIL; --n)
+        list = cdr(list);
+    RETURN(list == NIL ? NIL : car(list));
+}
+
+int32_t
+reverse(int32_t list)
+{
+    int32_t rval;
+    TRACE();
+    rval = NIL;
+    GC_PROTECT(list);
+    GC_PROTECT(rval);
+    for ( ; list != NIL; list = cdr(list))
+        rval = cons(car(list), rval);
+    GC_UNPROTECT(rval);
+    GC_UNPROTECT(list);
+    RETURN(rval);
+}
+
+int32_t
+map(int32_t proc, int32_t list)
+{
+    return mapn(proc, list, -1);
+}
+
+/* map proc over the first n elements of list, or all of them if n is -1 */
+int32_t
+mapn(int32_t proc, int32_t list, int32_t n)
+{
+    int32_t head, tail, cell;
+    TRACE();
+    head = tail = NIL;
+    GC_PROTECT(proc);
+    GC_PROTECT(list);
+    GC_PROTECT(head);
+    for ( ; list != NIL && n-- != 0; list = cdr(list)) {
+        cell = applyv(proc, cons(car(list), NIL));
+        cell = cons(cell, NIL);
+        if (head == NIL)
+            head = cell;
+        else
+            setcdr(tail, cell);
+        tail = cell;
+    }
+    GC_UNPROTECT(head);
+    GC_UNPROTECT(list);
+    GC_UNPROTECT(proc);
+    RETURN(head);
+}
+
+int32_t
+filter(int32_t proc, int32_t list)
+{
+    int32_t head, tail, cell;
+    TRACE();
+    head = tail = NIL;
+    GC_PROTECT(proc);
+    GC_PROTECT(list);
+    GC_PROTECT(head);
+    for ( ; list != NIL; list = cdr(list)) {
+        if (applyv(proc, cons(car(list), NIL)) == NIL)
+            continue;
+        cell = cons(car(list), NIL);
+        if (head == NIL)
+            head = cell;
+        else
+            setcdr(tail, cell);
+        tail = cell;
+    }
+    GC_UNPROTECT(head);
+    GC_UNPROTECT(list);
+    GC_UNPROTECT(proc);
+    RETURN(head);
 }
 
+/* (fold f init list) is (f (f (f init x1) x2) x3) */
 int32_t
-mapenv(int32_t (*fn)(int32_t t, int32_t e), int32_t list, int32_t env)
+fold(int32_t proc, int32_t init, int32_t list)
 {
+    int32_t args;
     TRACE();
-    assert(listp(list) == T);
-    if (nullp(list) == T)
-        RETURN(NIL);
-    RETURN(cons(fn(car(list), env), mapenv(fn, cdr(list), env)));
+    GC_PROTECT(proc);
+    GC_PROTECT(list);
+    GC_PROTECT(init);
+    for ( ; list != NIL; list = cdr(list)) {
+        args = cons(car(list), NIL);
+        args = cons(init, args);
+        init = applyv(proc, args);
+    }
+    GC_UNPROTECT(init);
+    GC_UNPROTECT(list);
+    GC_UNPROTECT(proc);
+    RETURN(init);
 }
 
 int32_t
@@ -282,9 +1210,6 @@ assoc(int32_t key, int32_t alist)
 {
     TRACE();
     assert(listp(alist) == T);
-    if (car(alist) == NIL) {
-        return NIL;
-    }
     for ( ; alist != NIL; alist = cdr(alist)) {
         if (cells[car(car(alist))].sym == cells[key].sym)
             RETURN(alist);
@@ -318,6 +1243,11 @@ eval(int32_t expr, int32_t env)
     int32_t binding;
     int foundp;
     int32_t args, body;
+    int32_t vec, n;
+    int32_t tab, key;
+    int64_t start, end;
+    int64_t count;
+    icache_t *ic;
     TRACE();
 //    printf("EVAL ");
 //    print(expr);
@@ -333,6 +1263,12 @@ eval(int32_t expr, int32_t env)
         RETURN(expr);
     if (symbolp(car(expr)) == T) {
         name = car(expr);
+        /* a cached site has fallen through the special forms before */
+        ic = &me->icache[expr % NICACHE];
+        if (ic->site == expr && ic->version == globalversion) {
+            proc = lookupcall(expr, env, &foundp);
+            RETURN(apply(cdr(proc), cdr(expr), env));
+        }
         if (symcmp(name, "env") == 0)
             RETURN(env);
         if (symcmp(name, "quote") == 0)
@@ -352,16 +1288,76 @@ eval(int32_t expr, int32_t env)
             RETURN(NIL);
         }
         if (symcmp(name, "read") == 0) {
-            RETURN(read(stdin));
+            RETURN(read(input));
+        }
+        if (symcmp(name, "cons") == 0) {
+            rval = eval(second(expr), env);
+            GC_PROTECT(rval);
+            n = eval(third(expr), env);
+            GC_UNPROTECT(rval);
+            RETURN(cons(rval, n));
+        }
+        if (symcmp(name, "hcons") == 0) {
+            rval = eval(second(expr), env);
+            GC_PROTECT(rval);
+            n = eval(third(expr), env);
+            GC_UNPROTECT(rval);
+            RETURN(hcons(rval, n));
+        }
+        if (symcmp(name, "list") == 0)
+            RETURN(mapenv(eval, cdr(expr), env));
+        if (symcmp(name, "reverse") == 0)
+            RETURN(reverse(eval(second(expr), env)));
+        if (symcmp(name, "append") == 0) {
+            args = mapenv(eval, cdr(expr), env);
+            if (args == NIL)
+                RETURN(NIL);
+            GC_PROTECT(args);
+            args = reverse(args);
+            for (rval = car(args), pair = cdr(args); pair != NIL; pair = cdr(pair))
+                rval = append(car(pair), rval);
+            GC_UNPROTECT(args);
+            RETURN(rval);
+        }
+        if (symcmp(name, "nth") == 0) {
+            n = eval(second(expr), env);
+            if (n < 0 || cells[n].type != NUMBER) {
+                fprintf(stderr, "Error: nth: bad index\n");
+                RETURN(NIL);
+            }
+            count = val(n);
+            RETURN(nth(count, eval(third(expr), env)));
+        }
+        if (symcmp(name, "map") == 0 || symcmp(name, "filter") == 0
+            || symcmp(name, "fold") == 0) {
+            args = mapenv(eval, cdr(expr), env);
+            proc = car(args);
+            if (proc < 0 || cells[proc].type != LAMBDA) {
+                fprintf(stderr, "Error: %s: not a procedure\n", getsym(name));
+                RETURN(NIL);
+            }
+            GC_PROTECT(args);
+            if (symcmp(name, "map") == 0)
+                rval = map(proc, second(args));
+            else if (symcmp(name, "filter") == 0)
+                rval = filter(proc, second(args));
+            else
+                rval = fold(proc, second(args), third(args));
+            GC_UNPROTECT(args);
+            RETURN(rval);
         }
-        if (symcmp(name, "cons") == 0)
-            RETURN(cons(eval(second(expr), env), eval(third(expr), env)));
         if (symcmp(name, "car") == 0)
             RETURN(car(eval(second(expr), env)));
         if (symcmp(name, "cdr") == 0)
             RETURN(cdr(eval(second(expr), env)));
-        if (symcmp(name, "eql") == 0)
-            RETURN(eql(eval(second(expr), env), eval(third(expr), env)));
+        if (symcmp(name, "eql") == 0) {
+            /* hash-consed structure is only the same if it stays alive */
+            rval = eval(second(expr), env);
+            GC_PROTECT(rval);
+            n = eval(third(expr), env);
+            GC_UNPROTECT(rval);
+            RETURN(eql(rval, n));
+        }
         if (symcmp(name, ">") == 0)
             RETURN(bool(val(eval(second(expr), env)) > val(eval(third(expr), env))));
         if (symcmp(name, ">=") == 0)
@@ -378,6 +1374,133 @@ eval(int32_t expr, int32_t env)
             RETURN(num(val(eval(second(expr), env)) + val(eval(third(expr), env))));
         if (symcmp(name, "-") == 0)
             RETURN(num(val(eval(second(expr), env)) - val(eval(third(expr), env))));
+        if (symcmp(name, "make-vector") == 0) {
+            n = eval(second(expr), env);
+            if (n < 0 || cells[n].type != NUMBER || val(n) < 0 || val(n) > INT32_MAX) {
+                fprintf(stderr, "Error: make-vector: bad length\n");
+                RETURN(NIL);
+            }
+            count = val(n);
+            rval = (cdr(cdr(expr)) != NIL) ? eval(third(expr), env) : NIL;
+            RETURN(make_vector(count, rval));
+        }
+        if (symcmp(name, "vector-length") == 0) {
+            vec = eval(second(expr), env);
+            if (vectorp(vec) != T) {
+                fprintf(stderr, "Error: vector-length: not a vector\n");
+                RETURN(NIL);
+            }
+            RETURN(num(cells[vec].vec->len));
+        }
+        if (symcmp(name, "vector-ref") == 0 || symcmp(name, "vector-set!") == 0) {
+            vec = eval(second(expr), env);
+            GC_PROTECT(vec);
+            n = eval(third(expr), env);
+            GC_PROTECT(n);
+            rval = (cdr(cdr(cdr(expr))) != NIL) ? eval(car(cdr(cdr(cdr(expr)))), env) : NIL;
+            GC_UNPROTECT(n);
+            GC_UNPROTECT(vec);
+            if (vectorp(vec) != T || n < 0 || cells[n].type != NUMBER) {
+                fprintf(stderr, "Error: %s: bad arguments\n", getsym(name));
+                RETURN(NIL);
+            }
+            if (val(n) < 0 || val(n) >= cells[vec].vec->len) {
+                fprintf(stderr, "Error: %s: index %ld out of range\n", getsym(name), val(n));
+                RETURN(NIL);
+            }
+            if (symcmp(name, "vector-ref") == 0)
+                RETURN(cells[vec].vec->elts[val(n)]);
+            if (refcounting) {
+                incref(rval);
+                decref(cells[vec].vec->elts[val(n)]);
+            }
+            cells[vec].vec->elts[val(n)] = rval;
+            RETURN(rval);
+        }
+        if (symcmp(name, "make-table") == 0)
+            RETURN(make_table(FALSE));
+        if (symcmp(name, "make-weak-table") == 0)
+            RETURN(make_table(TRUE));
+        if (symcmp(name, "table-get") == 0 || symcmp(name, "table-set!") == 0
+            || symcmp(name, "table-delete!") == 0) {
+            tab = eval(second(expr), env);
+            GC_PROTECT(tab);
+            key = eval(third(expr), env);
+            GC_PROTECT(key);
+            rval = (cdr(cdr(cdr(expr))) != NIL) ? eval(car(cdr(cdr(cdr(expr)))), env) : NIL;
+            GC_PROTECT(rval);
+            if (tablep(tab) != T) {
+                fprintf(stderr, "Error: %s: not a table\n", getsym(name));
+                rval = NIL;
+            } else if (symcmp(name, "table-get") == 0) {
+                n = table_get(tab, key, &foundp);
+                if (foundp)
+                    rval = n;
+            } else if (symcmp(name, "table-set!") == 0) {
+                table_set(tab, key, rval);
+            } else {
+                rval = bool(table_delete(tab, key));
+            }
+            GC_UNPROTECT(rval);
+            GC_UNPROTECT(key);
+            GC_UNPROTECT(tab);
+            RETURN(rval);
+        }
+        if (symcmp(name, "table-count") == 0) {
+            tab = eval(second(expr), env);
+            if (tablep(tab) != T) {
+                fprintf(stderr, "Error: table-count: not a table\n");
+                RETURN(NIL);
+            }
+            RETURN(num(table_count(tab)));
+        }
+        if (symcmp(name, "string-length") == 0) {
+            rval = eval(second(expr), env);
+            if (stringp(rval) != T) {
+                fprintf(stderr, "Error: string-length: not a string\n");
+                RETURN(NIL);
+            }
+            RETURN(num(cells[rval].str.len));
+        }
+        if (symcmp(name, "substring") == 0) {
+            rval = eval(second(expr), env);
+            if (stringp(rval) != T) {
+                fprintf(stderr, "Error: substring: not a string\n");
+                RETURN(NIL);
+            }
+            GC_PROTECT(rval);
+            n = eval(third(expr), env);
+            start = (n >= 0 && cells[n].type == NUMBER) ? val(n) : -1;
+            end = cells[rval].str.len;
+            if (cdr(cdr(cdr(expr))) != NIL) {
+                n = eval(car(cdr(cdr(cdr(expr)))), env);
+                end = (n >= 0 && cells[n].type == NUMBER) ? val(n) : -1;
+            }
+            if (start < 0 || end < start || end > cells[rval].str.len) {
+                GC_UNPROTECT(rval);
+                fprintf(stderr, "Error: substring: bad arguments\n");
+                RETURN(NIL);
+            }
+            n = make_string(end - start);
+            GC_UNPROTECT(rval);
+            memcpy(strbytes(n), strbytes(rval) + start, end - start);
+            RETURN(n);
+        }
+        if (symcmp(name, "string-append") == 0)
+            RETURN(string_append(mapenv(eval, cdr(expr), env)));
+        if (symcmp(name, "string=?") == 0 || symcmp(name, "string<?") == 0) {
+            rval = eval(second(expr), env);
+            GC_PROTECT(rval);
+            n = eval(third(expr), env);
+            GC_UNPROTECT(rval);
+            if (stringp(rval) != T || stringp(n) != T) {
+                fprintf(stderr, "Error: %s: not a string\n", getsym(name));
+                RETURN(NIL);
+            }
+            if (symcmp(name, "string=?") == 0)
+                RETURN(bool(string_compare(rval, n) == 0));
+            RETURN(bool(string_compare(rval, n) < 0));
+        }
         if (symcmp(name, "or") == 0) {
             assert(cdr(expr) != NIL);
             for (pair = cdr(expr); pair != NIL; pair = cdr(pair))
@@ -398,6 +1521,12 @@ eval(int32_t expr, int32_t env)
             } else {
                 setcdr(binding, rval);
             }
+            /* the caches only hold global bindings, so a local set! keeps them */
+            for (pair = env; pair != NIL && pair != topenv; pair = cdr(pair))
+                if (assoc(second(expr), car(pair)) != NIL)
+                    break;
+            if (pair == topenv)
+                ++globalversion;
             RETURN(rval);
         }
         if (symcmp(name, "and") == 0) {
@@ -417,9 +1546,10 @@ eval(int32_t expr, int32_t env)
             assert(cdr(expr) != NIL);
             if (eval(second(expr), env) == T)
                 RETURN(eval(third(expr), env));
-            else if (length(expr) == 4) {
+            else if (val(length(expr)) == 4) {
                 RETURN(eval(car(cdr(cdr(cdr(expr)))), env));
             }
+            RETURN(NIL);
         }
         if (symcmp(name, "define") == 0) {
             assert(cdr(expr) != NIL);
@@ -443,106 +1573,734 @@ eval(int32_t expr, int32_t env)
 //            printf("Value returned ");
 //            print(proc);
             }
-//        puts("NAME");
-//        print(name);
-//        puts("PROC");
-//        print(proc);
-            add_to_env(env, name, proc);
-//        puts("CAR ENV");
-//        print(car(env));
-            RETURN(proc);
+//        puts("NAME");
+//        print(name);
+//        puts("PROC");
+//        print(proc);
+            binding = assoc(name, car(env));
+            if (binding != NIL)
+                setcdr(car(binding), proc);
+            else
+                add_to_env(env, name, proc);
+            if (proc >= 0 && cells[proc].type == LAMBDA && procname[proc] == NULL)
+                procname[proc] = getsym(name);
+            ++globalversion;
+//        puts("CAR ENV");
+//        print(car(env));
+            RETURN(proc);
+        }
+        /* last, so they cost the forms above nothing */
+        if (symcmp(name, "future") == 0) {
+            proc = make_proc(cons(NIL, cdr(expr)), env);
+            RETURN(make_future(proc, NIL, -1));
+        }
+        if (symcmp(name, "touch") == 0)
+            RETURN(touch(eval(second(expr), env)));
+        if (symcmp(name, "pmap") == 0) {
+            args = mapenv(eval, cdr(expr), env);
+            proc = car(args);
+            if (proc < 0 || cells[proc].type != LAMBDA) {
+                fprintf(stderr, "Error: pmap: not a procedure\n");
+                RETURN(NIL);
+            }
+            GC_PROTECT(args);
+            rval = pmap(proc, second(args));
+            GC_UNPROTECT(args);
+            RETURN(rval);
+        }
+        if (symcmp(name, "delay") == 0)
+            RETURN(make_promise(make_proc(cons(NIL, cdr(expr)), env)));
+        if (symcmp(name, "force") == 0)
+            RETURN(force(eval(second(expr), env)));
+        if (symcmp(name, "cons-stream") == 0) {
+            rval = eval(second(expr), env);
+            GC_PROTECT(rval);
+            proc = make_promise(make_proc(cons(NIL, cdr(cdr(expr))), env));
+            GC_UNPROTECT(rval);
+            RETURN(cons(rval, proc));
+        }
+        if (symcmp(name, "stream-car") == 0) {
+            rval = eval(second(expr), env);
+            if (rval < 0 || cells[rval].type != CONS) {
+                fprintf(stderr, "Error: stream-car: not a stream\n");
+                RETURN(NIL);
+            }
+            RETURN(car(rval));
+        }
+        if (symcmp(name, "stream-cdr") == 0)
+            RETURN(stream_cdr(eval(second(expr), env)));
+        /* the stream is passed on unprotected so what's consumed can go */
+        if (symcmp(name, "stream-take") == 0) {
+            n = eval(second(expr), env);
+            if (n < 0 || cells[n].type != NUMBER) {
+                fprintf(stderr, "Error: stream-take: bad count\n");
+                RETURN(NIL);
+            }
+            count = val(n);
+            RETURN(stream_take(count, eval(third(expr), env)));
+        }
+        if (symcmp(name, "stream-filter") == 0) {
+            proc = eval(second(expr), env);
+            if (proc < 0 || cells[proc].type != LAMBDA) {
+                fprintf(stderr, "Error: stream-filter: not a procedure\n");
+                RETURN(NIL);
+            }
+            GC_PROTECT(proc);
+            rval = eval(third(expr), env);
+            GC_UNPROTECT(proc);
+            RETURN(stream_filter(proc, rval));
+        }
+//    LOG("APPLYING!!!");
+//    LOG("CAR ENV");
+//    print(env);
+//    print(car(env));
+//    printf("Looking up procedure\n");
+//    printf("Name: ");
+//    print(name);
+//    printf("Env: ");
+//    print(env);
+        proc = lookupcall(expr, env, &foundp);
+        if (!foundp) {
+            fprintf(stderr, "Error: Undefined function: %s\n", getsym(name));
+            RETURN(NIL);
+        }
+        RETURN(apply(cdr(proc), cdr(expr), env));
+    } else {
+//        printf("Procedure is a compound expression");
+        proc = eval(car(expr), env);
+        RETURN(apply(proc, cdr(expr), env));
+    }
+//    printf("Found function for symbol %s: ", getsym(name));
+//    print(proc);
+//    printf("Applying ");
+//    printf("Proc: ");
+//    print(cdr(proc));
+//    printf("Args: ");
+//    print(cdr(expr));
+    //RETURN(apply(cdr(proc), cdr(expr), env));
+}
+
+int32_t
+lookup(int32_t name, int32_t env, int *foundp)
+{
+    int32_t binding;
+    TRACE();
+    if (foundp) {
+        *foundp = 0;
+    }
+    for ( ; env != NIL; env = cdr(env)) {
+        binding = assoc(name, car(env));
+        if (binding != NIL) {
+            if (foundp) {
+                *foundp = 1;
+            }
+            RETURN(car(binding));
+        }
+    }
+    RETURN(NIL);
+}
+
+/*
+ * Find the binding for the procedure named at call site site.  Local
+ * frames are always searched, since they may shadow a global, but the
+ * global alist is only walked when the site's cache entry is stale.
+ */
+int32_t
+lookupcall(int32_t site, int32_t env, int *foundp)
+{
+    int32_t name;
+    int32_t binding;
+    icache_t *ic;
+
+    TRACE();
+    name = car(site);
+    *foundp = 1;
+    for ( ; env != NIL && env != topenv; env = cdr(env)) {
+        binding = assoc(name, car(env));
+        if (binding != NIL)
+            RETURN(car(binding));
+    }
+    ic = &me->icache[site % NICACHE];
+    if (ic->site == site && ic->version == globalversion)
+        RETURN(ic->binding);
+    binding = env == NIL ? NIL : assoc(name, car(env));
+    if (binding == NIL) {
+        *foundp = 0;
+        RETURN(NIL);
+    }
+    ic->site = site;
+    ic->binding = car(binding);
+    ic->version = globalversion;
+    RETURN(ic->binding);
+}
+
+int32_t
+apply(int32_t proc, int32_t args, int32_t env)
+{
+    int32_t rval;
+    //assert(eql(length(second(lambda)), length(params)));
+    /* push the values onto the environment alist as a stack */
+    TRACE();
+//    printf("APPLY\n");
+//    print(proc);
+    if (cells[proc].flags & PROC_LEAF)
+        RETURN(applyleaf(proc, args, env, TRUE));
+    GC_PROTECT(proc);
+    args = mapenv(eval, args, env);
+    GC_PROTECT(args);
+    rval = applyv(proc, args);
+    GC_UNPROTECT(args);
+    GC_UNPROTECT(proc);
+    RETURN(rval);
+}
+
+/* apply proc to a list of argument values that are already evaluated */
+int32_t
+applyv(int32_t proc, int32_t args)
+{
+    int32_t body;
+    int32_t rval;
+    int32_t frame;
+    int32_t expr;
+    int32_t cooked_args;
+
+    TRACE();
+    if (cells[proc].flags & PROC_LEAF)
+        RETURN(applyleaf(proc, args, NIL, FALSE));
+    body = cells[proc].proc.body;
+    GC_PROTECT(proc);
+    GC_PROTECT(args);
+//    printf("Env: ");
+//    print(env);
+//    printf("Body: ");
+//    print(body);
+    frame = make_env(cells[proc].proc.env);
+    GC_PROTECT(frame);
+//    printf("Raw args: ");
+//    print(args);
+    cooked_args = zip(cons, car(body), args);
+    GC_PROTECT(cooked_args);
+//    printf("Cooked args: ");
+//    print(cooked_args);
+    setcar(frame, cooked_args);
+    predefine(frame, cdr(body));
+//    printf("Apply frame: ");
+//    print(frame);
+    if (profiling && me == &mainthread)
+        prof_push(procname[proc] ? procname[proc] : "lambda");
+    rval = NIL;
+    for (expr = cdr(body); expr != NIL; expr = cdr(expr)) {
+//        printf("Evaluating ");
+//        print(car(expr));
+        rval = eval(car(expr), frame);
+    }
+    if (profiling && me == &mainthread)
+        prof_pop();
+    GC_UNPROTECT(cooked_args);
+    GC_UNPROTECT(frame);
+    GC_UNPROTECT(args);
+    GC_UNPROTECT(proc);
+    RETURN(rval);
+}
+
+/*
+ * Bind every name the body defines at its top level before running it,
+ * so closures made in the body capture those bindings even when the
+ * define comes later (mutually recursive internal procedures).
+ */
+void
+predefine(int32_t frame, int32_t body)
+{
+    int32_t def;
+    int32_t name;
+
+    TRACE();
+    for ( ; body != NIL; body = cdr(body)) {
+        def = car(body);
+        if (def < 0 || cells[def].type != CONS || car(def) < 0
+            || cells[car(def)].type != SYMBOL || symcmp(car(def), "define") != 0)
+            continue;
+        name = second(def);
+        if (cells[name].type == CONS)
+            name = car(name);
+        if (assoc(name, car(frame)) == NIL)
+            add_to_env(frame, name, NIL);
+    }
+    UNTRACE();
+}
+
+/*
+ * apply() for procedures whose body can't capture its frame.  The
+ * frame, its bindings and the argument spine all live in the region and
+ * are dropped on return; nothing is allocated on the heap for the call.
+ * args are evaluated in env first unless evalp is false.
+ */
+int32_t
+applyleaf(int32_t proc, int32_t args, int32_t env, int evalp)
+{
+    int32_t base;
+    int32_t frame;
+    int32_t params;
+    int32_t tail;
+    int32_t pair;
+    int32_t expr;
+    int32_t rval;
+
+    TRACE();
+    base = self->rtop;
+    GC_PROTECT(proc);
+    GC_PROTECT(args); /* values from applyv() may be reachable from nowhere else */
+    frame = rcons(NIL, cells[proc].proc.env);
+    GC_PROTECT(frame); /* in case the region spilled onto the heap */
+    tail = NIL;
+    params = car(cells[proc].proc.body);
+    for ( ; params != NIL && args != NIL; params = cdr(params), args = cdr(args)) {
+        rval = evalp ? eval(car(args), env) : car(args);
+        pair = rcons(rcons(car(params), rval), NIL);
+        if (tail == NIL)
+            setcar(frame, pair);
+        else
+            setcdr(tail, pair);
+        tail = pair;
+    }
+    predefine(frame, cdr(cells[proc].proc.body));
+    if (profiling && me == &mainthread)
+        prof_push(procname[proc] ? procname[proc] : "lambda");
+    rval = NIL;
+    for (expr = cdr(cells[proc].proc.body); expr != NIL; expr = cdr(expr))
+        rval = eval(car(expr), frame);
+    if (profiling && me == &mainthread)
+        prof_pop();
+    GC_UNPROTECT(frame);
+    GC_UNPROTECT(args);
+    GC_UNPROTECT(proc);
+    self->rtop = base;
+    RETURN(rval);
+}
+
+/*
+ * Futures.  make_future() queues the work and returns at once; a worker
+ * thread or whoever touches the future first runs it.  Every thread
+ * allocates from its own buffer, so the workers only meet on heaplock
+ * to refill, to hand results back and when one of them collects.
+ */
+int32_t
+make_future(int32_t proc, int32_t args, int32_t count)
+{
+    int32_t ptr;
+    future_t *f;
+
+    TRACE();
+    GC_PROTECT(proc);
+    GC_PROTECT(args);
+    ptr = getcell();
+    GC_UNPROTECT(args);
+    GC_UNPROTECT(proc);
+    f = malloc(sizeof *f);
+    assert(f != NULL);
+    f->cell = ptr;
+    f->proc = proc;
+    f->args = args;
+    f->count = count;
+    f->value = NIL;
+    f->state = QUEUED;
+    f->next = NULL;
+    cells[ptr].type = FUTURE;
+    cells[ptr].fut = f;
+    if (refcounting) {
+        incref(proc);
+        incref(args);
+    }
+    GC_PROTECT(ptr); /* lockheap() may collect */
+    lockheap();
+    if (lastjob)
+        lastjob->next = f;
+    else
+        jobs = f;
+    lastjob = f;
+    pthread_cond_broadcast(&changed);
+    unlockheap();
+    GC_UNPROTECT(ptr);
+    RETURN(ptr);
+}
+
+/* with heaplock held, take the oldest future nobody has started */
+future_t *
+popjob(void)
+{
+    future_t *f;
+
+    while ((f = jobs) != NULL) {
+        if ((jobs = f->next) == NULL)
+            lastjob = NULL;
+        if (f->state == QUEUED) {
+            f->state = RUNNING;
+            return f;
+        }
+    }
+    return NULL;
+}
+
+void
+runfuture(int32_t ptr)
+{
+    future_t *f;
+    int32_t rval;
+
+    TRACE();
+    GC_PROTECT(ptr);
+    f = cells[ptr].fut;
+    if (f->count < 0)
+        rval = applyv(f->proc, f->args);
+    else
+        rval = mapn(f->proc, f->args, f->count);
+    GC_PROTECT(rval);
+    lockheap();
+    if (refcounting)
+        incref(rval);
+    f->value = rval;
+    f->state = DONE;
+    pthread_cond_broadcast(&changed);
+    unlockheap();
+    GC_UNPROTECT(rval);
+    GC_UNPROTECT(ptr);
+    UNTRACE();
+}
+
+/* the value of a future, waiting for it or running it here if need be */
+int32_t
+touch(int32_t ptr)
+{
+    future_t *f;
+    int32_t rval;
+
+    TRACE();
+    if (ptr < 0 || cells[ptr].type != FUTURE)
+        RETURN(ptr);
+    GC_PROTECT(ptr);
+    f = cells[ptr].fut;
+    lockheap();
+    if (f->state == QUEUED) {
+        f->state = RUNNING;
+        unlockheap();
+        runfuture(ptr);
+        lockheap();
+    }
+    while (f->state != DONE)
+        blockon(&changed);
+    rval = f->value;
+    unlockheap();
+    GC_UNPROTECT(ptr);
+    RETURN(rval);
+}
+
+/*
+ * map over list in parallel: cut it into about four chunks per thread,
+ * so a slow chunk doesn't leave the rest idle, and splice the results.
+ */
+int32_t
+pmap(int32_t proc, int32_t list)
+{
+    int32_t futs, last, head, tail;
+    int32_t p, rval;
+    int32_t n, chunk, i;
+
+    TRACE();
+    for (n = 0, p = list; p != NIL; p = cdr(p))
+        ++n;
+    chunk = n / (4 * (nworkers + 1));
+    if (chunk < 1)
+        chunk = 1;
+    futs = last = head = tail = NIL;
+    GC_PROTECT(proc);
+    GC_PROTECT(list);
+    GC_PROTECT(futs);
+    GC_PROTECT(head);
+    for (p = list; p != NIL; ) {
+        rval = cons(make_future(proc, p, chunk), NIL);
+        if (futs == NIL)
+            futs = rval;
+        else
+            setcdr(last, rval);
+        last = rval;
+        for (i = 0; i < chunk && p != NIL; ++i)
+            p = cdr(p);
+    }
+    for (p = futs; p != NIL; p = cdr(p)) {
+        rval = touch(car(p));
+        if (rval == NIL)
+            continue;
+        if (head == NIL)
+            head = rval;
+        else
+            setcdr(tail, rval);
+        for (tail = rval; cdr(tail) != NIL; tail = cdr(tail))
+            ;
+    }
+    GC_UNPROTECT(head);
+    GC_UNPROTECT(futs);
+    GC_UNPROTECT(list);
+    GC_UNPROTECT(proc);
+    RETURN(head);
+}
+
+/*
+ * Promises and streams.  A promise holds a procedure of no arguments
+ * until it is forced, then the value the procedure returned, so the
+ * procedure and what it captured become garbage.  A stream is NIL or a
+ * cons of its first element and a promise of the rest; the stream
+ * builtins walk one keeping hold only of the current cons, so the
+ * collector reclaims the prefix already consumed as they go.
+ */
+int32_t
+make_promise(int32_t proc)
+{
+    int32_t ptr;
+
+    TRACE();
+    GC_PROTECT(proc);
+    ptr = getcell();
+    GC_UNPROTECT(proc);
+    cells[ptr].type = PROMISE;
+    cells[ptr].promise.proc = proc;
+    cells[ptr].promise.value = NIL;
+    if (refcounting)
+        incref(proc);
+    RETURN(ptr);
+}
+
+/*
+ * The value of a promise, computing it the first time.  Forced again
+ * while it computes, here or on another thread, a promise keeps the
+ * value stored first.  Anything else forces to itself.
+ *
+ * The rest of a filtered stream holds (proc . s) instead of a procedure,
+ * s the cons last matched.  The first thread to force it takes s out,
+ * leaving T, so only the search itself holds on to the cells it passes
+ * over, and any other thread forcing it waits for the value.
+ */
+int32_t
+force(int32_t ptr)
+{
+    int32_t proc;
+    int32_t rval;
+    int32_t s;
+    int filter;
+
+    TRACE();
+    if (ptr < 0 || cells[ptr].type != PROMISE)
+        RETURN(ptr);
+    GC_PROTECT(ptr);
+    lockheap();
+    proc = cells[ptr].promise.proc;
+    while (proc >= 0 && cells[proc].type == CONS && cdr(proc) == T) {
+        blockon(&changed);
+        proc = cells[ptr].promise.proc;
+    }
+    filter = proc >= 0 && cells[proc].type == CONS;
+    s = NIL;
+    if (filter) {
+        s = cdr(proc);
+        setcdr(proc, T);
+    }
+    unlockheap();
+    if (proc != NIL) {
+        rval = filter ? stream_filter(car(proc), stream_cdr(s)) : applyv(proc, NIL);
+        GC_PROTECT(rval);
+        lockheap();
+        if (cells[ptr].promise.proc != NIL) {
+            if (refcounting) {
+                incref(rval);
+                decref(cells[ptr].promise.proc);
+            }
+            cells[ptr].promise.proc = NIL;
+            cells[ptr].promise.value = rval;
         }
-//    LOG("APPLYING!!!");
-//    LOG("CAR ENV");
-//    print(env);
-//    print(car(env));
-//    printf("Looking up procedure\n");
-//    printf("Name: ");
-//    print(name);
-//    printf("Env: ");
-//    print(env);
-        proc = lookup(name, env, &foundp);
-        if (!foundp) {
-            fprintf(stderr, "Error: Undefined function: %s\n", getsym(name));
-            RETURN(NIL);
-        }
-        RETURN(apply(cdr(proc), cdr(expr), env));
-    } else {
-//        printf("Procedure is a compound expression");
-        proc = eval(car(expr), env);
-        RETURN(apply(proc, cdr(expr), env));
+        if (filter)
+            pthread_cond_broadcast(&changed);
+        unlockheap();
+        GC_UNPROTECT(rval);
     }
-//    printf("Found function for symbol %s: ", getsym(name));
-//    print(proc);
-//    printf("Applying ");
-//    printf("Proc: ");
-//    print(cdr(proc));
-//    printf("Args: ");
-//    print(cdr(expr));
-    //RETURN(apply(cdr(proc), cdr(expr), env));
+    lockheap();
+    rval = cells[ptr].promise.value;
+    unlockheap();
+    GC_UNPROTECT(ptr);
+    RETURN(rval);
 }
 
 int32_t
-lookup(int32_t name, int32_t env, int *foundp)
+stream_cdr(int32_t s)
 {
-    int32_t binding;
     TRACE();
-    if (foundp) {
-        *foundp = 0;
+    if (s < 0 || cells[s].type != CONS) {
+        fprintf(stderr, "Error: stream-cdr: not a stream\n");
+        RETURN(NIL);
     }
-    for ( ; env != NIL; env = cdr(env)) {
-        binding = assoc(name, car(env));
-        if (binding != NIL) {
-            if (foundp) {
-                *foundp = 1;
-            }
-            RETURN(car(binding));
+    RETURN(force(cdr(s)));
+}
+
+/* a list of the first n elements of s, forcing no more of it than that */
+int32_t
+stream_take(int64_t n, int32_t s)
+{
+    int32_t head, tail, cell;
+
+    TRACE();
+    head = tail = NIL;
+    GC_PROTECT(s);
+    GC_PROTECT(head);
+    while (n > 0 && s != NIL) {
+        if (s < 0 || cells[s].type != CONS) {
+            fprintf(stderr, "Error: stream-take: not a stream\n");
+            break;
         }
+        cell = cons(car(s), NIL);
+        if (head == NIL)
+            head = cell;
+        else
+            setcdr(tail, cell);
+        tail = cell;
+        if (--n > 0)
+            s = stream_cdr(s);
     }
-    RETURN(NIL);
+    GC_UNPROTECT(head);
+    GC_UNPROTECT(s);
+    RETURN(head);
 }
 
+/*
+ * The elements of s that proc is true of, as a stream.  Only the first
+ * is looked for now; the promise in its cdr finds the next one.
+ */
 int32_t
-apply(int32_t proc, int32_t args, int32_t env)
+stream_filter(int32_t proc, int32_t s)
 {
-    int32_t body;
-    int32_t rval;
-    int32_t frame;
-    int32_t expr;
-    int32_t cooked_args;
-    //assert(eql(length(second(lambda)), length(params)));
-    /* push the values onto the environment alist as a stack */
+    int32_t args;
+    int32_t rest;
+
     TRACE();
-//    printf("APPLY\n");
-//    print(proc);
-    body = cells[proc].proc.body;
-    GC_PROTECT(env);
-//    printf("Env: ");
-//    print(env);
-//    printf("Body: ");
-//    print(body);
-    frame = make_env(cells[proc].proc.env);
-    GC_PROTECT(frame);
+    args = NIL;
+    GC_PROTECT(proc);
+    GC_PROTECT(s);
     GC_PROTECT(args);
-//    printf("Raw args: ");
-//    print(args);
-    cooked_args = zip(cons, car(body), mapenv(eval, args, env));
-    GC_PROTECT(cooked_args);
-//    printf("Cooked args: ");
-//    print(cooked_args);
-    setcar(frame, cooked_args);
-//    printf("Apply frame: ");
-//    print(frame);
-    for (expr = cdr(body); expr != NIL; expr = cdr(expr)) {
-//        printf("Evaluating ");
-//        print(car(expr));
-        rval = eval(car(expr), frame);
+    for ( ; s != NIL; s = stream_cdr(s)) {
+        if (s < 0 || cells[s].type != CONS) {
+            fprintf(stderr, "Error: stream-filter: not a stream\n");
+            s = NIL;
+            break;
+        }
+        args = cons(car(s), NIL);
+        if (applyv(proc, args) != NIL)
+            break;
+    }
+    if (s != NIL) {
+        rest = make_promise(cons(proc, s));
+        s = cons(car(s), rest);
     }
-    GC_UNPROTECT(cooked_args);
     GC_UNPROTECT(args);
-    GC_UNPROTECT(frame);
-    GC_UNPROTECT(env);
-    RETURN(rval);
+    GC_UNPROTECT(s);
+    GC_UNPROTECT(proc);
+    RETURN(s);
+}
+
+/*
+ * Run whatever is still queued and wait for the workers to go idle.
+ * main() does this after each top-level expression, so no future
+ * outlives the expression that made it, and compact() and the reader
+ * have the heap to themselves.
+ */
+void
+drain(void)
+{
+    future_t *f;
+
+    TRACE();
+    lockheap();
+    for (;;) {
+        if ((f = popjob()) != NULL) {
+            unlockheap();
+            runfuture(f->cell);
+            lockheap();
+        } else if (nbusy > 0)
+            blockon(&changed);
+        else
+            break;
+    }
+    unlockheap();
+    UNTRACE();
+}
+
+/* an idle worker waits in blockon(), so it never holds up a collection */
+void *
+worker(void *arg)
+{
+    future_t *f;
+
+    me = arg;
+    bindmutator(&me->m);
+    lockheap();
+    for (;;) {
+        while ((f = popjob()) == NULL)
+            blockon(&changed);
+        ++nbusy;
+        unlockheap();
+        runfuture(f->cell);
+        lockheap();
+        --nbusy;
+        pthread_cond_broadcast(&changed);
+    }
+    return NULL;
+}
+
+void
+startworkers(int n)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    thread_t *t;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKERSTACK);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (nworkers = 0; nworkers < n; ++nworkers) {
+        t = calloc(1, sizeof *t);
+        assert(t != NULL);
+        addmutator(&t->m);
+        if (pthread_create(&tid, &attr, worker, t) != 0) {
+            fprintf(stderr, "Error: can't start worker %d\n", nworkers);
+            delmutator(&t->m);
+            free(t);
+            break;
+        }
+        threads[nthreads++] = t;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* what the collector can't find by itself: queued futures and inline caches */
+void
+gcevent(int event)
+{
+    future_t *f;
+    int i, t;
+
+    switch (event) {
+    case GC_BEGIN:
+    case GC_END:
+        prof_gc(event == GC_BEGIN);
+        break;
+    case GC_ROOTS:
+        for (f = jobs; f; f = f->next)
+            gc_root(&f->cell);
+        break;
+    case GC_SWEEP:
+        for (t = 0; t < nthreads; ++t)
+            for (i = 0; i < NICACHE; ++i)
+                if (!gc_live(threads[t]->icache[i].site)
+                    || !gc_live(threads[t]->icache[i].binding))
+                    threads[t]->icache[i].site = NIL;
+        break;
+    }
 }
 
 int32_t
@@ -569,17 +2327,12 @@ zip(int32_t (*fn)(int32_t, int32_t), int32_t list1, int32_t list2)
     pair = fn(car(list1), car(list2));
     GC_PROTECT(pair);
     rval = cons(pair, zip(fn, cdr(list1), cdr(list2)));
+    GC_UNPROTECT(pair);
+    GC_UNPROTECT(list2);
+    GC_UNPROTECT(list1);
     RETURN(rval);
 }
 
-void
-printstats(void)
-{
-    TRACE();
-    printf("Used %d Free %d Total %d\n",
-           MAXCELLS-navail, navail, MAXCELLS);
-    UNTRACE();
-}
 
 int32_t
 readlist(FILE *fp)
@@ -588,20 +2341,26 @@ readlist(FILE *fp)
     int32_t cdr;
     int32_t list;
     TRACE();
-    assert(peek != EOF);
+    skipspace(fp);
+    /* a list cut off by the end of input comes back as EOF */
+    if (peek == EOF) {
+        fprintf(stderr, "Error: read: unexpected end of input\n");
+        RETURN(EOF);
+    }
     if (peek == ')') {
         LOG("Returning NIL");
         RETURN(NIL);
     }
-    /* printf("Consing "); */
     car = read(fp);
-    assert(car != NIL);
+    if (car == EOF)
+        RETURN(EOF);
     GC_PROTECT(car);
     cdr = readlist(fp);
-    assert(cdr != NIL);
     GC_PROTECT(cdr);
-    list = cons(car, cdr);
-    assert(list != NIL);
+    if (cdr == EOF)
+        list = EOF;
+    else
+        list = hashconsing ? hcons(car, cdr) : cons(car, cdr);
     GC_UNPROTECT(cdr);
     GC_UNPROTECT(car);
     /* printf("Consing "); */
@@ -621,8 +2380,7 @@ read(FILE *fp)
     assert(fp != NULL);
     TRACE();
 //    LOG("Starting on char '%c'", peek);
-    while (isspace(peek))
-        peek = fgetc(fp);
+    skipspace(fp);
     if (peek == EOF) {
         LOG("Reached EOF");
         RETURN(EOF);
@@ -632,38 +2390,95 @@ read(FILE *fp)
         while ((peek = fgetc(fp)) != EOF && isdigit(peek))
             j = j*10 + (peek - '0');
         LOG("Read number %d", j);
-        RETURN(num(j));
+        RETURN(hashconsing ? hnum(j) : num(j));
+    }
+    if (peek == '"') {
+        peek = fgetc(fp);
+        RETURN(readstring(fp));
     }
     if (peek == '(') {
         peek = fgetc(fp);
         /* printf("Reading list\n"); */
         root = readlist(fp);
         /* printf("Returning list @ cell %d\n", root); */
-        assert(peek == ')');
+        if (root == EOF)
+            RETURN(EOF);
         peek = fgetc(fp);
         RETURN(root);
     }
-    if (isgraph(peek)) {
-        i = 0;
-        buf[i++] = peek;
-        for ( ; i < sizeof(buf)-1 && (peek = fgetc(fp)) != EOF && peek != '(' && peek != ')' && !isspace(peek); ++i)
-            buf[i] = peek;
-        buf[i++] = '\0';
-        if (i == sizeof(buf)) {
-            while (peek != EOF && isalnum(peek))
-                peek = fgetc(fp);
+    i = 0;
+    buf[i++] = peek;
+    for ( ; i < sizeof(buf)-1 && (peek = fgetc(fp)) != EOF && peek != '(' && peek != ')' && !isspace(peek); ++i)
+        buf[i] = peek;
+    buf[i++] = '\0';
+    if (i == sizeof(buf)) {
+        while (peek != EOF && isalnum(peek))
+            peek = fgetc(fp);
+    }
+    /*
+      if (strcmp(buf, "nil") == 0)
+      RETURN(NIL);
+      if (strcmp(buf, "t") == 0)
+      RETURN(T);
+    */
+    root = sym(buf);
+    /* printf("Returning symbol cell %d @ '%s\n", root, buf); */
+    RETURN(root);
+}
+
+/* skip whitespace, reporting and dropping any byte that can't start a token */
+void
+skipspace(FILE *fp)
+{
+    for ( ; peek != EOF && !isgraph(peek); peek = fgetc(fp))
+        if (!isspace(peek))
+            fprintf(stderr, "Error: read: unexpected character %#x\n", peek);
+}
+
+int32_t
+readstring(FILE *fp)
+{
+    char *buf, *p;
+    int32_t len, cap;
+    int32_t ptr;
+
+    TRACE();
+    cap = 64;
+    buf = malloc(cap);
+    /* on running out of memory, still read up to the closing quote */
+    for (len = 0; peek != EOF && peek != '"'; peek = fgetc(fp)) {
+        if (peek == '\\') {
+            peek = fgetc(fp);
+            if (peek == 'n')
+                peek = '\n';
+            else if (peek == 't')
+                peek = '\t';
+            else if (peek == EOF)
+                break;
         }
-        /*
-          if (strcmp(buf, "nil") == 0)
-          RETURN(NIL);
-          if (strcmp(buf, "t") == 0)
-          RETURN(T);
-        */
-        root = sym(buf);
-        /* printf("Returning symbol cell %d @ '%s\n", root, buf); */
-        RETURN(root);
+        if (buf == NULL)
+            continue;
+        if (len == cap) {
+            p = cap <= INT32_MAX / 2 ? realloc(buf, cap *= 2) : NULL;
+            if (p == NULL) {
+                free(buf);
+                buf = NULL;
+                continue;
+            }
+            buf = p;
+        }
+        buf[len++] = peek;
     }
-    RETURN(NIL);
+    if (peek == '"')
+        peek = fgetc(fp);
+    if (buf == NULL) {
+        fprintf(stderr, "Error: out of memory for string literal\n");
+        RETURN(NIL);
+    }
+    ptr = make_string(len);
+    memcpy(strbytes(ptr), buf, len);
+    free(buf);
+    RETURN(ptr);
 }
 
 int32_t
@@ -671,11 +2486,16 @@ sym(char *s)
 {
     int32_t ptr;
     TRACE();
+    lockheap();
+    s = intern(s);
+    unlockheap();
+    if (hashconsing)
+        RETURN(hsym(s));
     ptr = getcell();
     assert(ptr >= 0);
     LOG("Allocating symbol '%s' in cell %d", s, ptr);
     cells[ptr].type = SYMBOL;
-    cells[ptr].sym = intern(s);
+    cells[ptr].sym = s;
 //    printmem();
     RETURN(ptr);
 }
@@ -687,189 +2507,83 @@ atomp(int32_t ptr)
     RETURN((ptr == NIL ||
             ptr == T ||
             cells[ptr].type == SYMBOL ||
-            cells[ptr].type == NUMBER) ? T : NIL);
-}
-
-int32_t
-listp(int32_t obj)
-{
-    TRACE();
-    if (obj == NIL)
-        RETURN(T);
-    if (cells[obj].type == CONS)
-        RETURN(T);
-    RETURN(NIL);
-}
-
-void
-initcells(void)
-{
-    int32_t i;
-    for (i = 0; i < NELEM(cells)-1; ++i) {
-        cells[i].type = CONS;
-        cells[i].cons.car = NIL;
-        cells[i].cons.cdr = i+1;
-        cells[i].marked = FALSE;
-    }
-    cells[i].type = CONS;
-    cells[i].cons.car = NIL;
-    cells[i].cons.cdr = NIL;
-    cells[i].marked = FALSE;
-    avail = 0;
-    navail = MAXCELLS;
-}
-
-int
-gc(void)
-{
-    struct gc_stack_root *root;
-//    printf("Collecting garbage...\n");
-//    printf("Env: %d\n", env);
-    for (root = gc_roots; root; root = root->prev) {
-//        printf("Starting from cell %d...\n", root->cell);
-        mark(root->cell);
-    }
-    return sweep();
+            cells[ptr].type == NUMBER ||
+            cells[ptr].type == VECTOR ||
+            cells[ptr].type == TABLE ||
+            cells[ptr].type == STRING) ? T : NIL);
 }
 
 int32_t
-getcell(void)
+vectorp(int32_t obj)
 {
-    int32_t ptr;
-    TRACE();
-    if (avail == NIL && !gc()) {
-        assert(0);
-        RETURN(-1);
-    }
-    ptr = avail;
-    avail = cells[ptr].cons.cdr;
-    cells[ptr].cons.car = 0;
-    cells[ptr].cons.cdr = 0;
-    cells[ptr].marked = FALSE;
-    --navail;
-    RETURN(ptr);
+    if (obj < 0)
+        return NIL;
+    return cells[obj].type == VECTOR ? T : NIL;
 }
 
 int32_t
-cons(int32_t a, int32_t b)
+tablep(int32_t obj)
 {
-    int32_t ptr;
-    GC_PROTECT(a);
-    GC_PROTECT(b);
-    ptr = getcell();
-    GC_UNPROTECT(b);
-    GC_UNPROTECT(a);
-    assert(ptr != NIL);
-    cells[ptr].cons.car = a;
-    cells[ptr].cons.cdr = b;
-    LOG("Allocating cons cell %d", ptr);
-//    printmem();
-    return ptr;
+    if (obj < 0)
+        return NIL;
+    return cells[obj].type == TABLE ? T : NIL;
 }
 
 int32_t
-num(int64_t n)
+listp(int32_t obj)
 {
-    int32_t ptr;
     TRACE();
-    ptr = getcell();
-    assert(ptr != NIL);
-    LOG("Allocating number %ld at cell %d", n, ptr);
-    cells[ptr].type = NUMBER;
-    cells[ptr].num = n;
-//    printmem();
-    RETURN(ptr);
+    if (obj == NIL)
+        RETURN(T);
+    if (cells[obj].type == CONS)
+        RETURN(T);
+    RETURN(NIL);
 }
 
 int32_t
-car(int32_t ptr)
-{
-    TRACE();
-    assert(cells[ptr].type == CONS);
-    RETURN(cells[ptr].cons.car);
-}
-
-void
-setcar(int32_t ptr, int32_t val)
+stringp(int32_t obj)
 {
-    TRACE();
-    assert(cells[ptr].type == CONS);
-    cells[ptr].cons.car = val;
-    UNTRACE();
+    if (obj < 0)
+        return NIL;
+    return cells[obj].type == STRING ? T : NIL;
 }
 
 int32_t
-cdr(int32_t ptr)
-{
-    TRACE();
-    assert(cells[ptr].type == CONS);
-    RETURN(cells[ptr].cons.cdr);
-}
-
-void
-setcdr(int32_t ptr, int32_t val)
+string_append(int32_t list)
 {
-    TRACE();
-    assert(cells[ptr].type == CONS);
-    cells[ptr].cons.cdr = val;
-    UNTRACE();
-}
-
-int64_t
-val(int32_t ptr)
-{
-    assert(cells[ptr].type == NUMBER);
-    return cells[ptr].num;
-}
+    int32_t ptr;
+    int32_t len;
+    int32_t p;
 
-void
-mark(int32_t ptr)
-{
     TRACE();
-    if (ptr < 0 || cells[ptr].marked) {
-        return;
+    for (len = 0, p = list; p != NIL; p = cdr(p)) {
+        if (stringp(car(p)) != T) {
+            fprintf(stderr, "Error: string-append: not a string\n");
+            RETURN(NIL);
+        }
+        len += cells[car(p)].str.len;
     }
-    cells[ptr].marked = TRUE;
-//    printf("Marked cell %d\n", ptr);
-    switch (cells[ptr].type) {
-    case LAMBDA:
-        mark(cells[ptr].proc.body);
-        mark(cells[ptr].proc.env);
-        break;
-    case CONS:
-        mark(car(ptr));
-        mark(cdr(ptr));
-        break;
-    case NUMBER:
-    case SYMBOL:
-        break;
+    GC_PROTECT(list);
+    ptr = make_string(len);
+    GC_UNPROTECT(list);
+    for (len = 0, p = list; p != NIL; p = cdr(p)) {
+        memcpy(strbytes(ptr) + len, strbytes(car(p)), cells[car(p)].str.len);
+        len += cells[car(p)].str.len;
     }
-    UNTRACE();
+    RETURN(ptr);
 }
 
 int32_t
-sweep(void)
+string_compare(int32_t a, int32_t b)
 {
-    int32_t i;
-    int32_t nmarked;
-    TRACE();
-    avail = NIL;
-    LOG("Sweeping...");
-    for (i = nmarked = 0; i < NELEM(cells); ++i) {
-        if (!cells[i].marked) {
-//            printf("Reclaiming cell %d ", i);
-//            print(i);
-            cells[i].type = CONS;
-            cells[i].cons.car = NIL;
-            cells[i].cons.cdr = avail;
-            avail = i;
-        } else
-            ++nmarked;
-        cells[i].marked = FALSE;
-    }
-    navail = MAXCELLS - nmarked;
-    LOG("%d cells free", navail);
-    RETURN(navail);
+    int32_t n;
+    int r;
+
+    n = cells[a].str.len < cells[b].str.len ? cells[a].str.len : cells[b].str.len;
+    r = memcmp(strbytes(a), strbytes(b), n);
+    if (r != 0)
+        return r;
+    return cells[a].str.len - cells[b].str.len;
 }
 
 char *
@@ -882,6 +2596,8 @@ getsym(int32_t ptr)
 void
 printrec(int32_t ptr)
 {
+    int32_t i;
+    char c;
     TRACE();
     if (ptr == NIL) {
         printf("nil");
@@ -895,17 +2611,50 @@ printrec(int32_t ptr)
         case LAMBDA:
             printf("<procedure@%d/%d>", cells[ptr].proc.body, cells[ptr].proc.env);
             break;
+        case FUTURE:
+            printf("<future@%d>", ptr);
+            break;
+        case PROMISE:
+            printf("<promise@%d>", ptr);
+            break;
+        case TABLE:
+            printf("<table@%d>", ptr);
+            break;
         case NUMBER:
             printf("%ld", cells[ptr].num);
             break;
+        case VECTOR:
+            printf("#(");
+            for (i = 0; i < cells[ptr].vec->len; ++i) {
+                if (i > 0)
+                    putchar(' ');
+                printrec(cells[ptr].vec->elts[i]);
+            }
+            putchar(')');
+            break;
+        case STRING:
+            putchar('"');
+            for (i = 0; i < cells[ptr].str.len; ++i) {
+                c = strbytes(ptr)[i];
+                if (c == '"' || c == '\\')
+                    putchar('\\');
+                if (c == '\n')
+                    printf("\\n");
+                else if (c == '\t')
+                    printf("\\t");
+                else
+                    putchar(c);
+            }
+            putchar('"');
+            break;
         case CONS:
             putchar('(');
             printrec(car(ptr));
-            if (cdr(ptr) != NIL && cells[cdr(ptr)].type != CONS) {
+            if (cdr(ptr) != NIL && (cdr(ptr) == T || cells[cdr(ptr)].type != CONS)) {
                 printf(" . ");
                 printrec(cdr(ptr));
             } else {
-                for (ptr = cdr(ptr); ptr != NIL && cells[ptr].type == CONS; ptr = cdr(ptr)) {
+                for (ptr = cdr(ptr); ptr >= 0 && cells[ptr].type == CONS; ptr = cdr(ptr)) {
                     putchar(' ');
                     printrec(car(ptr));
                 }
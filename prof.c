@@ -0,0 +1,216 @@
+/*
+ * Sampling profiler for Lisp procedures.  The interpreter keeps a shadow
+ * stack of the names of the procedures it is applying; every SIGPROF
+ * copies that stack into a preallocated pool.  At exit the samples are
+ * summed into a report on stderr and a folded-stack file for
+ * flamegraph.pl.
+ */
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "prof.h"
+
+enum { NSTACK = 256 };     /* deepest stack a sample keeps */
+enum { NPOOL = 1 << 20 };  /* names kept across all samples */
+enum { NSAMPLES = 1 << 18 };
+enum { NSTATS = 1 << 10 };
+enum { INTERVAL = 1000 };  /* microseconds of CPU time per sample */
+
+struct sample {
+    uint32_t off; /* first name in pool, outermost frame first */
+    uint32_t len;
+};
+
+struct procstat {
+    char *name;
+    long self;
+    long total;
+};
+
+static char *GCNAME = "[gc]";
+static char *TOPNAME = "[toplevel]";
+static char *OTHERNAME = "[other]";
+
+static char *volatile stack[NSTACK];
+static volatile sig_atomic_t depth;
+static volatile sig_atomic_t ingc;
+
+static char **pool;
+static uint32_t npool;
+static struct sample *samples;
+static long nsamples;
+static long ndropped;
+static int nstats;
+
+static void prof_report(void);
+
+static void
+sample(int sig)
+{
+    int n, i;
+
+    (void) sig;
+    n = depth < NSTACK ? depth : NSTACK;
+    if (nsamples == NSAMPLES || npool + n + 1 > NPOOL) {
+        ++ndropped;
+        return;
+    }
+    samples[nsamples].off = npool;
+    for (i = 0; i < n; ++i)
+        pool[npool++] = stack[i];
+    if (n == 0 && !ingc)
+        pool[npool++] = TOPNAME;
+    if (ingc)
+        pool[npool++] = GCNAME;
+    samples[nsamples].len = npool - samples[nsamples].off;
+    ++nsamples;
+}
+
+void
+prof_start(void)
+{
+    struct sigaction sa;
+    struct itimerval it;
+
+    pool = malloc(NPOOL * sizeof pool[0]);
+    samples = malloc(NSAMPLES * sizeof samples[0]);
+    if (pool == NULL || samples == NULL) {
+        fprintf(stderr, "Error: no memory for profile samples\n");
+        return;
+    }
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = sample;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = INTERVAL;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_PROF, &it, NULL);
+    atexit(prof_report);
+}
+
+void
+prof_push(char *name)
+{
+    if (depth < NSTACK)
+        stack[depth] = name;
+    ++depth;
+}
+
+void
+prof_pop(void)
+{
+    --depth;
+}
+
+void
+prof_gc(int on)
+{
+    ingc = on;
+}
+
+/* the last free slot goes to OTHERNAME, which counts every name that didn't fit */
+static struct procstat *
+lookupstat(struct procstat *stats, char *name)
+{
+    unsigned h;
+    int i;
+
+    h = (uintptr_t) name / sizeof(char *) % NSTATS;
+    for (i = 0; i < NSTATS && stats[h].name != NULL; ++i, h = (h + 1) % NSTATS)
+        if (stats[h].name == name)
+            return &stats[h];
+    if (i == NSTATS || (nstats == NSTATS - 1 && name != OTHERNAME))
+        return lookupstat(stats, OTHERNAME);
+    ++nstats;
+    stats[h].name = name;
+    return &stats[h];
+}
+
+static int
+byself(const void *a, const void *b)
+{
+    const struct procstat *x = a, *y = b;
+
+    if (x->self != y->self)
+        return x->self < y->self ? 1 : -1;
+    return x->total < y->total ? 1 : x->total > y->total ? -1 : 0;
+}
+
+static int
+bystack(const void *a, const void *b)
+{
+    const struct sample *x = a, *y = b;
+    uint32_t i;
+
+    for (i = 0; i < x->len && i < y->len; ++i)
+        if (pool[x->off + i] != pool[y->off + i])
+            return (uintptr_t) pool[x->off + i] < (uintptr_t) pool[y->off + i] ? -1 : 1;
+    return (int) x->len - (int) y->len;
+}
+
+/* count name once toward the total of each sample it appears in */
+static int
+seen(struct sample *s, uint32_t i)
+{
+    uint32_t j;
+
+    for (j = 0; j < i; ++j)
+        if (pool[s->off + j] == pool[s->off + i])
+            return 1;
+    return 0;
+}
+
+static void
+prof_report(void)
+{
+    static struct procstat stats[NSTATS];
+    struct itimerval it;
+    struct sample *s;
+    long i, j, n;
+    uint32_t k;
+    FILE *fp;
+    char *path;
+
+    memset(&it, 0, sizeof it);
+    setitimer(ITIMER_PROF, &it, NULL);
+    for (i = 0; i < nsamples; ++i) {
+        s = &samples[i];
+        lookupstat(stats, pool[s->off + s->len - 1])->self++;
+        for (k = 0; k < s->len; ++k)
+            if (!seen(s, k))
+                lookupstat(stats, pool[s->off + k])->total++;
+    }
+    for (i = n = 0; i < NSTATS; ++i)
+        if (stats[i].name != NULL)
+            stats[n++] = stats[i];
+    qsort(stats, n, sizeof stats[0], byself);
+    fprintf(stderr, "%ld samples of %d us", nsamples, INTERVAL);
+    if (ndropped)
+        fprintf(stderr, ", %ld dropped", ndropped);
+    fprintf(stderr, "\n%8s %8s  %s\n", "self%", "total%", "procedure");
+    for (i = 0; i < n && nsamples > 0; ++i)
+        fprintf(stderr, "%8.2f %8.2f  %s\n", 100.0 * stats[i].self / nsamples,
+                100.0 * stats[i].total / nsamples, stats[i].name);
+
+    if ((path = getenv("GCTEST_PROFILE")) == NULL)
+        path = "gctest.folded";
+    if ((fp = fopen(path, "w")) == NULL) {
+        perror(path);
+        return;
+    }
+    qsort(samples, nsamples, sizeof samples[0], bystack);
+    for (i = 0; i < nsamples; i = j) {
+        for (j = i + 1; j < nsamples && bystack(&samples[i], &samples[j]) == 0; ++j)
+            ;
+        s = &samples[i];
+        for (k = 0; k < s->len; ++k)
+            fprintf(fp, "%s%s", k ? ";" : "", pool[s->off + k]);
+        fprintf(fp, " %ld\n", j - i);
+    }
+    fclose(fp);
+}
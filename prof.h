@@ -0,0 +1,4 @@
+extern void prof_start(void);
+extern void prof_push(char *name);
+extern void prof_pop(void);
+extern void prof_gc(int on);
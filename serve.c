@@ -0,0 +1,84 @@
+/*
+ * The socket side of gctest -s.  A client connects to a Unix domain
+ * socket, sends a batch of expressions and closes its end for writing;
+ * the interpreter reads the batch from the stream serve_accept() hands
+ * it, with stdout and stderr sent down the same connection, and
+ * serve_done() puts them back, which ends the client's stream of
+ * results.  Connections are served one at a time; the rest wait in the
+ * listen queue.
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "serve.h"
+
+static int out = -1, err = -1; /* the server's own stdout and stderr */
+
+/* a socket listening at path, replacing any left there, or -1 */
+int
+serve_listen(char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "Error: socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+        || bind(fd, (struct sockaddr *) &addr, sizeof addr) < 0
+        || listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    /* a client that hangs up early only loses its results */
+    signal(SIGPIPE, SIG_IGN);
+    fflush(stdout);
+    out = dup(STDOUT_FILENO);
+    err = dup(STDERR_FILENO);
+    return fd;
+}
+
+/* wait for the next client and return its batch, or NULL if fd fails */
+FILE *
+serve_accept(int fd)
+{
+    FILE *fp;
+    int conn;
+
+    for (;;) {
+        if ((conn = accept(fd, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "Error: accept: %s\n", strerror(errno));
+            close(fd);
+            return NULL;
+        }
+        if ((fp = fdopen(conn, "r")) != NULL)
+            break;
+        close(conn);
+    }
+    dup2(conn, STDOUT_FILENO);
+    dup2(conn, STDERR_FILENO);
+    return fp;
+}
+
+void
+serve_done(FILE *fp)
+{
+    fflush(stdout);
+    fclose(fp);
+    dup2(out, STDOUT_FILENO);
+    dup2(err, STDERR_FILENO);
+}
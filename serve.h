@@ -0,0 +1,3 @@
+extern int serve_listen(char *path);
+extern FILE *serve_accept(int fd);
+extern void serve_done(FILE *fp);
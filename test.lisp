@@ -9,3 +9,7 @@
 (seq 1 2)
 (seq 1 2)
 (seq 1 2)
+(nth (+ 0 2) (seq 1 40))
+(nth (+ 0 2) (seq 1 40))
+(nth (+ 0 2) (seq 1 40))
+(vector-length (make-vector (+ 1 2) (seq 1 30)))
@@ -0,0 +1,33 @@
+/*
+ * Layout of the file written by a -DTRACE_RING build when it exits and
+ * read back by tracedump.  Function and message names are written once
+ * each in a string table and events refer to them by id.
+ */
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x52544347 /* "GCTR" */
+
+enum { EV_ENTER, EV_EXIT, EV_LOG };
+
+struct trace_header {
+    uint32_t magic;
+    uint32_t nstrings;
+    uint64_t nevents;
+    uint64_t lost;      /* events overwritten before the dump */
+    uint64_t tsc0, ns0; /* clock readings at the first event ... */
+    uint64_t tsc1, ns1; /* ... and at the dump, to scale timestamps */
+};
+
+/* followed by the string table, then the events oldest first */
+struct trace_string {
+    uint64_t id;
+    uint32_t len; /* bytes of name that follow, without a '\0' */
+};
+
+struct trace_event {
+    uint64_t tsc;
+    uint64_t id;  /* address of the function or message name */
+    int64_t arg;
+    uint32_t kind;
+    uint32_t pad;
+};
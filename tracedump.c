@@ -0,0 +1,277 @@
+/*
+ * Decode a trace written by a -DTRACE_RING build of gctest.
+ *
+ *   tracedump [-j | -f] [gctest.trace]
+ *
+ * -j (the default) prints Chrome trace JSON, for chrome://tracing or
+ * Perfetto.  -f prints folded stacks with the nanoseconds spent in each,
+ * for flamegraph.pl.  A function that returns without UNTRACE() leaves
+ * no exit event behind, so an exit pops every frame above the matching
+ * entry, and an exit with no entry (lost when the ring wrapped) is
+ * ignored.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+struct name {
+    uint64_t id;
+    char *s;
+};
+
+/* folded mode: one node per distinct call path */
+struct node {
+    int32_t parent;
+    int32_t name;
+    uint64_t self; /* ticks spent with this path on top */
+};
+
+struct frame {
+    int32_t name;
+    int32_t node;
+};
+
+static struct name *names;
+static uint32_t nnames;
+static uint32_t namecap;
+
+static struct node *nodes;
+static int32_t nnodes;
+static int32_t nodecap;
+static int32_t *nodetab;
+static uint32_t nodetabsize;
+
+static struct frame *stack;
+static int32_t depth;
+static int32_t stackcap;
+
+static struct trace_header hdr;
+static double tickns = 1.0; /* nanoseconds per timestamp tick */
+static int firstout = 1;
+
+static void *
+xrealloc(void *p, size_t n)
+{
+    if ((p = realloc(p, n)) == NULL) {
+        fprintf(stderr, "tracedump: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static int32_t
+lookupname(uint64_t id)
+{
+    uint32_t h;
+
+    for (h = id % namecap; names[h].s != NULL; h = (h + 1) % namecap)
+        if (names[h].id == id)
+            return h;
+    return -1;
+}
+
+static char *
+namestr(int32_t name)
+{
+    return name < 0 ? "?" : names[name].s;
+}
+
+static void
+readnames(FILE *fp)
+{
+    struct trace_string str;
+    uint32_t i, h;
+    char *s;
+
+    for (namecap = 64; namecap < 2 * hdr.nstrings; namecap *= 2)
+        ;
+    names = xrealloc(NULL, namecap * sizeof names[0]);
+    memset(names, 0, namecap * sizeof names[0]);
+    for (i = 0; i < hdr.nstrings; ++i) {
+        if (fread(&str, sizeof str, 1, fp) != 1)
+            break;
+        s = xrealloc(NULL, str.len + 1);
+        if (fread(s, 1, str.len, fp) != str.len)
+            break;
+        s[str.len] = '\0';
+        for (h = str.id % namecap; names[h].s != NULL; h = (h + 1) % namecap)
+            ;
+        names[h].id = str.id;
+        names[h].s = s;
+        ++nnames;
+    }
+}
+
+static int32_t
+child(int32_t parent, int32_t name)
+{
+    uint32_t h;
+    int32_t i, n;
+
+    if (2 * nnodes >= nodetabsize) {
+        free(nodetab);
+        nodetabsize = nodetabsize ? 2 * nodetabsize : 1024;
+        nodetab = xrealloc(NULL, nodetabsize * sizeof nodetab[0]);
+        memset(nodetab, -1, nodetabsize * sizeof nodetab[0]);
+        for (i = 0; i < nnodes; ++i) {
+            h = ((uint32_t) nodes[i].parent * 31 + nodes[i].name) % nodetabsize;
+            while (nodetab[h] >= 0)
+                h = (h + 1) % nodetabsize;
+            nodetab[h] = i;
+        }
+    }
+    h = ((uint32_t) parent * 31 + name) % nodetabsize;
+    for ( ; (n = nodetab[h]) >= 0; h = (h + 1) % nodetabsize)
+        if (nodes[n].parent == parent && nodes[n].name == name)
+            return n;
+    if (nnodes == nodecap) {
+        nodecap = nodecap ? 2 * nodecap : 1024;
+        nodes = xrealloc(nodes, nodecap * sizeof nodes[0]);
+    }
+    nodes[nnodes].parent = parent;
+    nodes[nnodes].name = name;
+    nodes[nnodes].self = 0;
+    nodetab[h] = nnodes;
+    return nnodes++;
+}
+
+static double
+usec(uint64_t tsc)
+{
+    return (tsc - hdr.tsc0) * tickns / 1000.0;
+}
+
+static void
+jsonstr(char *s)
+{
+    putchar('"');
+    for ( ; *s; ++s) {
+        if (*s == '"' || *s == '\\')
+            putchar('\\');
+        if ((unsigned char) *s >= ' ')
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+static void
+jsonevent(char *ph, int32_t name, uint64_t tsc, struct trace_event *ev)
+{
+    printf(firstout ? "\n" : ",\n");
+    firstout = 0;
+    printf("{\"name\":");
+    jsonstr(namestr(name));
+    printf(",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":1", ph, usec(tsc));
+    if (ev != NULL)
+        printf(",\"s\":\"t\",\"args\":{\"arg\":%lld}", (long long) ev->arg);
+    printf("}");
+}
+
+static void
+push(int32_t name)
+{
+    if (depth == stackcap) {
+        stackcap = stackcap ? 2 * stackcap : 256;
+        stack = xrealloc(stack, stackcap * sizeof stack[0]);
+    }
+    stack[depth].name = name;
+    stack[depth].node = child(depth ? stack[depth-1].node : -1, name);
+    ++depth;
+}
+
+static void
+printpath(int32_t n)
+{
+    if (nodes[n].parent >= 0) {
+        printpath(nodes[n].parent);
+        putchar(';');
+    }
+    fputs(namestr(nodes[n].name), stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct trace_event ev;
+    uint64_t last;
+    int32_t name, i;
+    int folded = 0;
+    char *path = "gctest.trace";
+    FILE *fp;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-f") == 0)
+            folded = 1;
+        else if (strcmp(argv[i], "-j") == 0)
+            folded = 0;
+        else if (argv[i][0] != '-')
+            path = argv[i];
+        else {
+            fprintf(stderr, "usage: %s [-j | -f] [file]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if ((fp = fopen(path, "rb")) == NULL) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    if (fread(&hdr, sizeof hdr, 1, fp) != 1 || hdr.magic != TRACE_MAGIC) {
+        fprintf(stderr, "%s: not a gctest trace\n", path);
+        return EXIT_FAILURE;
+    }
+    if (hdr.lost)
+        fprintf(stderr, "%s: %llu older events were overwritten\n",
+                path, (unsigned long long) hdr.lost);
+    if (hdr.tsc1 > hdr.tsc0)
+        tickns = (double) (hdr.ns1 - hdr.ns0) / (hdr.tsc1 - hdr.tsc0);
+    readnames(fp);
+    if (!folded)
+        printf("{\"traceEvents\":[");
+    last = hdr.tsc0;
+    while (fread(&ev, sizeof ev, 1, fp) == 1) {
+        if (folded && depth > 0)
+            nodes[stack[depth-1].node].self += ev.tsc - last;
+        last = ev.tsc;
+        name = lookupname(ev.id);
+        switch (ev.kind) {
+        case EV_ENTER:
+            push(name);
+            if (!folded)
+                jsonevent("B", name, ev.tsc, NULL);
+            break;
+        case EV_EXIT:
+            for (i = depth - 1; i >= 0 && stack[i].name != name; --i)
+                ;
+            if (i < 0)
+                break;
+            while (depth > i) {
+                --depth;
+                if (!folded)
+                    jsonevent("E", stack[depth].name, ev.tsc, NULL);
+            }
+            break;
+        case EV_LOG:
+            if (!folded)
+                jsonevent("i", name, ev.tsc, &ev);
+            break;
+        }
+    }
+    fclose(fp);
+    if (!folded) {
+        while (depth > 0) {
+            --depth;
+            jsonevent("E", stack[depth].name, last, NULL);
+        }
+        printf("\n]}\n");
+        return EXIT_SUCCESS;
+    }
+    for (i = 0; i < nnodes; ++i) {
+        if (nodes[i].self == 0)
+            continue;
+        printpath(i);
+        printf(" %.0f\n", nodes[i].self * tickns);
+    }
+    return EXIT_SUCCESS;
+}